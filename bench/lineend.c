@@ -0,0 +1,180 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Times the line ending kernels in src/encoding.c against the byte loops
+ * they replaced, on 32 MB of generated text. Build from the top directory:
+ *
+ *   cc -O2 bench/lineend.c -o lineend `pkg-config --cflags --libs glib-2.0`
+ *
+ * and add -mavx2 for the AVX2 kernel. Each case prints the best of a few
+ * runs, in milliseconds.
+ */
+
+#include "../src/encoding.c"
+
+#define BENCH_SIZE	(32 * 1024 * 1024)
+#define BENCH_RUNS	5
+
+/* the functions as they were, renamed */
+static void old_convert_line_ending_to_lf(gchar *text)
+{
+	gint i, j;
+	
+	for (i = 0, j = 0; TRUE; i++, j++) {
+		if (*(text + i) == CR) {
+			*(text + j) = LF;
+			if (*(text + i + 1) == LF)
+				i++;
+		} else {
+			*(text + j) = *(text + i);
+			if (*(text + j) == '\0')
+				break;
+		}
+	}
+}
+
+static void old_convert_line_ending(gchar **text, gint retcode)
+{
+	gchar *buf, *str = *text;
+	const gint len = strlen(str);
+	gint i, j, LFNum = 0;
+	
+	switch (retcode) {
+	case CR:
+		while (*str != '\0') {
+			if (*str == LF)
+				*str = CR;
+			str++;
+		}
+		break;
+	case CR+LF:
+		for (i = 0; *(str + i) != '\0'; i++) {
+			if (*(str + i) == LF)
+				LFNum++;
+		}
+		buf = g_new(gchar, len + LFNum + 1);
+		for (i= 0, j = 0;; i++, j++) {
+			if (*(str + j) == LF) {
+				*(buf + i) = CR;
+				*(buf + (++i)) = LF;
+			} else
+				*(buf + i) = *(str + j);
+			if (*(str + j) == '\0')
+				break;
+		}
+		g_free(*text);
+		*text = buf;
+	}
+}
+
+/* lines of 20 to 100 printable chars, ended by lineend */
+static gchar *make_text(const gchar *lineend)
+{
+	GString *gstr = g_string_sized_new(BENCH_SIZE + 128);
+	GRand *rand = g_rand_new_with_seed(1);
+	gint i, n;
+	
+	while (gstr->len < BENCH_SIZE) {
+		n = g_rand_int_range(rand, 20, 100);
+		for (i = 0; i < n; i++)
+			g_string_append_c(gstr, g_rand_int_range(rand, ' ', '~' + 1));
+		g_string_append(gstr, lineend);
+	}
+	g_rand_free(rand);
+	
+	return g_string_free(gstr, FALSE);
+}
+
+static void to_lf_old(gchar *text)
+{
+	old_convert_line_ending_to_lf(text);
+}
+
+static void to_lf_new(gchar *text)
+{
+	LineEndStats stats = { 0, 0, 0, FALSE };
+	gsize len;
+	
+	/* counts each kind of line ending as well */
+	len = convert_line_ending_to_lf_len(text, strlen(text), &stats);
+	text[len] = '\0';
+}
+
+static void to_crlf_old(gchar *text)
+{
+	gchar *str = g_strdup(text);
+	
+	old_convert_line_ending(&str, CR+LF);
+	g_free(str);
+}
+
+static void to_crlf_new(gchar *text)
+{
+	gchar *str = g_strdup(text);
+	
+	convert_line_ending(&str, CR+LF);
+	g_free(str);
+}
+
+static gdouble run(void (*func)(gchar *), const gchar *text)
+{
+	GTimer *timer = g_timer_new();
+	gdouble best = G_MAXDOUBLE;
+	gchar *copy;
+	gint i;
+	
+	for (i = 0; i < BENCH_RUNS; i++) {
+		copy = g_strdup(text);
+		g_timer_start(timer);
+		func(copy);
+		best = MIN(best, g_timer_elapsed(timer, NULL));
+		g_free(copy);
+	}
+	g_timer_destroy(timer);
+	
+	return best * 1000;
+}
+
+static void report(const gchar *name, void (*old)(gchar *),
+	void (*new)(gchar *), const gchar *text)
+{
+	gdouble t_old = run(old, text), t_new = run(new, text);
+	
+	g_print("%-24s %8.1f %8.1f %6.1fx\n", name, t_old, t_new, t_old / t_new);
+}
+
+gint main(void)
+{
+	gchar *lf = make_text("\n"), *crlf = make_text("\r\n");
+	
+#ifdef VECTOR_BLOCK
+	g_print("vector block: %d bytes\n", VECTOR_BLOCK);
+#else
+	g_print("no vector kernel\n");
+#endif
+	g_print("%-24s %8s %8s %7s\n", "", "old ms", "new ms", "");
+	report("LF text to LF", to_lf_old, to_lf_new, lf);
+	report("CR+LF text to LF", to_lf_old, to_lf_new, crlf);
+	report("LF text to CR+LF", to_crlf_old, to_crlf_new, lf);
+	g_free(lf);
+	g_free(crlf);
+	
+	return 0;
+}
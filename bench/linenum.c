@@ -0,0 +1,187 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Times scrolling through a long buffer with line numbers off and on,
+ * using src/linenum.c as it is, then the two ways of drawing the numbers
+ * against each other: a paint per digit from ten shaped digits, and one
+ * paint per number from the cached layouts in src/linenum.c. The window
+ * has to be shown, so this needs a display. Build from the top directory:
+ *
+ *   cc -O2 bench/linenum.c -o linenum `pkg-config --cflags --libs gtk+-2.0`
+ *
+ * It scrolls down the whole buffer in even steps, painting each one at
+ * once, and prints the mean time per step in milliseconds. The first pass
+ * only lays the text out, so that both timed passes find it done.
+ *
+ * The drawing is timed on a gutter's worth of numbers painted straight into
+ * the gutter window, per page in milliseconds: the same page over and over,
+ * as a full expose redraws it, and every page of the buffer in turn, as
+ * paging down does, where each number is new to the cache.
+ */
+
+#include "../src/linenum.c"
+
+#define BENCH_LINES	200000
+#define BENCH_STEPS	2000
+#define BENCH_PAGE	50	/* lines to a gutter */
+#define BENCH_REPEATS	2000
+
+static PangoLayout *digit_layout[10];
+static gint digit_width[10];
+
+static void init_digits(GtkWidget *widget)
+{
+	gchar str[2] = "0";
+	gint i;
+	
+	for (i = 0; i < 10; i++) {
+		str[0] = '0' + i;
+		digit_layout[i] = gtk_widget_create_pango_layout(widget, str);
+		pango_layout_set_attributes(digit_layout[i], number_attrs);
+		pango_layout_get_pixel_size(digit_layout[i], &digit_width[i], NULL);
+	}
+}
+
+/* as src/linenum.c drew them before the cache */
+static void draw_number_digits(GtkWidget *widget, GdkWindow *win,
+	gint x, gint y, gint n)
+{
+	gint d;
+	
+	do {
+		d = n % 10;
+		x -= digit_width[d];
+		gtk_paint_layout(widget->style, win, GTK_WIDGET_STATE(widget),
+			FALSE, NULL, widget, NULL, x, y, digit_layout[d]);
+		n /= 10;
+	} while (n);
+}
+
+typedef void (*DrawNumber)(GtkWidget *, GdkWindow *, gint, gint, gint);
+
+/* pages of numbers from first, moving on by advance lines a page */
+static gdouble paint_pages(GtkWidget *view, DrawNumber draw,
+	gint first, gint advance, gint pages)
+{
+	GdkWindow *win;
+	GTimer *timer;
+	gdouble elapsed;
+	gint i, j, n;
+	
+	win = gtk_text_view_get_window(GTK_TEXT_VIEW(view),
+		GTK_TEXT_WINDOW_LEFT);
+	clear_number_layouts();
+	gdk_flush();
+	timer = g_timer_new();
+	for (i = 0; i < pages; i++) {
+		n = first + advance * i;
+		for (j = 0; j < BENCH_PAGE; j++)
+			draw(view, win, number_width, j * digit_max_width * 2,
+				n + j);
+	}
+	gdk_flush();
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	
+	return elapsed * 1000 / pages;
+}
+
+static void flush_events(void)
+{
+	while (gtk_events_pending())
+		gtk_main_iteration();
+}
+
+static gdouble scroll_through(GtkAdjustment *vadj)
+{
+	GTimer *timer;
+	gdouble step, elapsed;
+	gint i;
+	
+	gtk_adjustment_set_value(vadj, vadj->lower);
+	flush_events();
+	step = (vadj->upper - vadj->page_size - vadj->lower) / BENCH_STEPS;
+	timer = g_timer_new();
+	for (i = 1; i <= BENCH_STEPS; i++) {
+		gtk_adjustment_set_value(vadj, vadj->lower + step * i);
+		gdk_window_process_all_updates();
+	}
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	
+	return elapsed * 1000 / BENCH_STEPS;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GtkWidget *window, *sw, *view;
+	GtkAdjustment *vadj;
+	GString *gstr;
+	gdouble off, on, digits_same, cached_same, digits_new, cached_new;
+	gint i, pages;
+	
+	gtk_init(&argc, &argv);
+	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_default_size(GTK_WINDOW(window), 600, 800);
+	sw = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
+		GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(window), sw);
+	view = gtk_text_view_new();
+	gtk_container_add(GTK_CONTAINER(sw), view);
+	
+	gstr = g_string_new(NULL);
+	for (i = 0; i < BENCH_LINES; i++)
+		g_string_append_printf(gstr,
+			"line %d of some text to lay out and paint\n", i + 1);
+	gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(view)),
+		gstr->str, gstr->len);
+	g_string_free(gstr, TRUE);
+	
+	linenum_init(view);
+	gtk_widget_show_all(window);
+	flush_events();
+	vadj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(sw));
+	
+	scroll_through(vadj);
+	off = scroll_through(vadj);
+	show_line_numbers(view, TRUE);
+	flush_events();
+	on = scroll_through(vadj);
+	
+	init_digits(view);
+	pages = BENCH_LINES / BENCH_PAGE;
+	digits_same = paint_pages(view, draw_number_digits,
+		BENCH_LINES - BENCH_PAGE, 0, BENCH_REPEATS);
+	cached_same = paint_pages(view, draw_number,
+		BENCH_LINES - BENCH_PAGE, 0, BENCH_REPEATS);
+	digits_new = paint_pages(view, draw_number_digits, 1, BENCH_PAGE, pages);
+	cached_new = paint_pages(view, draw_number, 1, BENCH_PAGE, pages);
+	
+	g_print("%d lines, %d steps\n", BENCH_LINES, BENCH_STEPS);
+	g_print("line numbers off: %.3f ms per step\n", off);
+	g_print("line numbers on:  %.3f ms per step\n", on);
+	g_print("%d numbers, same page:  per digit %.3f ms, cached %.3f ms\n",
+		BENCH_PAGE, digits_same, cached_same);
+	g_print("%d numbers, every page: per digit %.3f ms, cached %.3f ms\n",
+		BENCH_PAGE, digits_new, cached_new);
+	
+	return 0;
+}
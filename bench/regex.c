@@ -0,0 +1,164 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Times regular expression search in src/textsearch.c against the literal
+ * engine, on 32 MB of generated log lines, and the compiled pattern kept
+ * by a TextSearch against compiling it again for each Find Next. Build
+ * from the top directory:
+ *
+ *   cc -O2 bench/regex.c -o regex `pkg-config --cflags --libs gtk+-2.0`
+ *
+ * Each case prints the best of a few runs, in milliseconds, and the number
+ * of matches found.
+ */
+
+#include "../src/textsearch.c"
+
+#define BENCH_SIZE	(32 * 1024 * 1024)
+#define BENCH_RUNS	3
+#define BENCH_NEXT	10000	/* Find Next presses */
+
+static const gchar *log_words[] = {
+	"INFO", "DEBUG", "request", "served", "GET", "POST", "/api/v1/items",
+	"status=200", "status=404", "user=42", "took", "ms", "cache", "hit",
+	"miss", "Error", "worker-7", "queue", "flushed", "retry", "connection"
+};
+
+/* lines of a few random words */
+static gchar *make_text(void)
+{
+	GString *gstr = g_string_sized_new(BENCH_SIZE + 256);
+	GRand *rand = g_rand_new_with_seed(1);
+	gint i, n;
+	
+	while (gstr->len < BENCH_SIZE) {
+		n = g_rand_int_range(rand, 4, 16);
+		for (i = 0; i < n; i++) {
+			if (i)
+				g_string_append_c(gstr, ' ');
+			g_string_append(gstr,
+				log_words[g_rand_int_range(rand, 0, G_N_ELEMENTS(log_words))]);
+		}
+		g_string_append_c(gstr, '\n');
+	}
+	g_rand_free(rand);
+	
+	return g_string_free(gstr, FALSE);
+}
+
+typedef struct {
+	const gchar *text;
+	gsize len;
+	const gchar *str;
+	TextSearchFlags flags;
+	gint count;
+} Bench;
+
+/* every match, from one TextSearch */
+static void find_all(Bench *b)
+{
+	TextSearch *ts = text_search_new(b->str, b->flags, NULL);
+	gsize pos = 0, start, end;
+	
+	b->count = 0;
+	while (text_search_find_text(ts, b->text, b->len, pos, &start, &end)) {
+		pos = end;
+		b->count++;
+	}
+	text_search_unref(ts);
+}
+
+/* Find Next on a line at a time, with the pattern kept */
+static void find_next_cached(Bench *b)
+{
+	TextSearch *ts = text_search_new(b->str, b->flags, NULL);
+	const gchar *line = b->text, *next;
+	gsize start, end;
+	
+	for (b->count = 0; b->count < BENCH_NEXT
+		&& (next = strchr(line, '\n')); line = next + 1) {
+		if (text_search_find_text(ts, line, next - line, 0, &start, &end))
+			b->count++;
+	}
+	text_search_unref(ts);
+}
+
+/* the same, with the pattern compiled again for each one */
+static void find_next_compiled(Bench *b)
+{
+	TextSearch *ts;
+	const gchar *line = b->text, *next;
+	gsize start, end;
+	
+	for (b->count = 0; b->count < BENCH_NEXT
+		&& (next = strchr(line, '\n')); line = next + 1) {
+		ts = text_search_new(b->str, b->flags, NULL);
+		if (text_search_find_text(ts, line, next - line, 0, &start, &end))
+			b->count++;
+		text_search_unref(ts);
+	}
+}
+
+static void report(const gchar *name, void (*func)(Bench *), Bench *b)
+{
+	GTimer *timer = g_timer_new();
+	gdouble best = G_MAXDOUBLE;
+	gint i;
+	
+	for (i = 0; i < BENCH_RUNS; i++) {
+		g_timer_start(timer);
+		func(b);
+		best = MIN(best, g_timer_elapsed(timer, NULL));
+	}
+	g_timer_destroy(timer);
+	
+	g_print("%-36s %9.1f %8d\n", name, best * 1000, b->count);
+}
+
+gint main(void)
+{
+	gchar *text = make_text();
+	Bench b;
+	
+	b.text = text;
+	b.len = strlen(text);
+	g_print("%-36s %9s %8s\n", "", "ms", "matches");
+	
+	b.str = "error";
+	b.flags = 0;
+	report("literal \"error\", any case", find_all, &b);
+	b.flags = TEXT_SEARCH_REGEX;
+	report("regex \"error\", any case", find_all, &b);
+	b.str = "Error";
+	b.flags = TEXT_SEARCH_MATCH_CASE;
+	report("literal \"Error\"", find_all, &b);
+	b.flags = TEXT_SEARCH_MATCH_CASE | TEXT_SEARCH_REGEX;
+	report("regex \"Error\"", find_all, &b);
+	b.str = "status=4\\d\\d";
+	report("regex \"status=4\\d\\d\"", find_all, &b);
+	b.str = "^GET .*took$";
+	report("regex \"^GET .*took$\"", find_all, &b);
+	b.str = "user=(\\d+)";
+	report("Find Next, pattern kept", find_next_cached, &b);
+	report("Find Next, compiled each time", find_next_compiled, &b);
+	g_free(text);
+	
+	return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Times the TextSearch kernel in src/textsearch.c against the helpers of
+ * src/gtksourceiter.c it took over from, ignoring case, on 32 MB of
+ * generated log lines and of mixed Japanese and ASCII text. The old
+ * helpers were called on one line at a time, which is what this does for
+ * them too. Build from the top directory:
+ *
+ *   cc -O2 bench/search.c -o search `pkg-config --cflags --libs gtk+-2.0`
+ *
+ * Each case prints the best of a few runs, in milliseconds, and the number
+ * of matches found, which the two have to agree on.
+ */
+
+#include "../src/textsearch.c"
+
+#define BENCH_SIZE	(32 * 1024 * 1024)
+#define BENCH_RUNS	3
+
+/* as in gtksourceiter.c, renamed */
+static const gchar *
+pointer_from_offset_skipping_decomp (const gchar *str, gint offset)
+{
+	gsize decomp_len;
+	gunichar *decomp;
+	const gchar *p;
+
+	p = str;
+	while (offset > 0)
+	{
+		decomp = g_unicode_canonical_decomposition (g_utf8_get_char (p), &decomp_len);
+		g_free (decomp);
+		p = g_utf8_next_char (p);
+		offset -= decomp_len;
+	}
+	return p;
+}
+
+static const gchar *
+old_utf8_strcasestr (const gchar *haystack, const gchar *needle)
+{
+	gsize needle_len;
+	gsize haystack_len;
+	const gchar *ret = NULL;
+	gchar *p;
+	gchar *casefold;
+	gchar *caseless_haystack;
+	gint i;
+
+	g_return_val_if_fail (haystack != NULL, NULL);
+	g_return_val_if_fail (needle != NULL, NULL);
+
+	casefold = g_utf8_casefold (haystack, -1);
+	caseless_haystack = g_utf8_normalize (casefold, -1, G_NORMALIZE_DEFAULT);
+	g_free (casefold);
+
+	needle_len = g_utf8_strlen (needle, -1);
+	haystack_len = g_utf8_strlen (caseless_haystack, -1);
+
+	if (needle_len == 0)
+	{
+		ret = (gchar *)haystack;
+		goto finally_1;
+	}
+
+	if (haystack_len < needle_len)
+	{
+		ret = NULL;
+		goto finally_1;
+	}
+
+	p = (gchar*)caseless_haystack;
+	needle_len = strlen (needle);
+	i = 0;
+
+	while (*p)
+	{
+		if ((strncmp (p, needle, needle_len) == 0))
+		{
+			ret = pointer_from_offset_skipping_decomp (haystack, i);
+			goto finally_1;
+		}
+
+		p = g_utf8_next_char (p);
+		i++;
+	}
+
+finally_1:
+	g_free (caseless_haystack);
+
+	return ret;
+}
+
+static const gchar *log_words[] = {
+	"INFO", "DEBUG", "request", "served", "GET", "POST", "/api/v1/items",
+	"status=200", "user=42", "took", "ms", "cache", "hit", "miss", "Error",
+	"worker-7", "queue", "flushed", "retry", "connection"
+};
+
+static const gchar *mixed_words[] = {
+	"東京", "大阪", "の", "は", "です", "ファイル", "を", "開きました",
+	"検索", "結果", "file", "Error", "line", "テキスト", "エディタ", "、", "。"
+};
+
+/* lines of a few random words, with a match every so often */
+static gchar *make_text(const gchar **words, gint n_words)
+{
+	GString *gstr = g_string_sized_new(BENCH_SIZE + 256);
+	GRand *rand = g_rand_new_with_seed(1);
+	gint i, n;
+	
+	while (gstr->len < BENCH_SIZE) {
+		n = g_rand_int_range(rand, 4, 16);
+		for (i = 0; i < n; i++) {
+			g_string_append(gstr, words[g_rand_int_range(rand, 0, n_words)]);
+			g_string_append_c(gstr, ' ');
+		}
+		g_string_append_c(gstr, '\n');
+	}
+	g_rand_free(rand);
+	
+	return g_string_free(gstr, FALSE);
+}
+
+static gint count_old(const gchar *text, const gchar *needle)
+{
+	const gchar *line = text, *next, *p, *q;
+	gchar *folded, *str;
+	gint count = 0;
+	
+	/* gtk_source_iter_forward_search() folded the needle once */
+	str = g_utf8_casefold(needle, -1);
+	folded = g_utf8_normalize(str, -1, G_NORMALIZE_ALL);
+	g_free(str);
+	for (; *line; line = next) {
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		str = g_strndup(line, next - line);
+		for (p = str; (q = old_utf8_strcasestr(p, folded)); count++)
+			p = g_utf8_offset_to_pointer(q, g_utf8_strlen(needle, -1));
+		g_free(str);
+	}
+	g_free(folded);
+	
+	return count;
+}
+
+static gint count_new(const gchar *text, const gchar *needle)
+{
+	TextSearch *ts = text_search_new(needle, 0, NULL);
+	gsize len = strlen(text), pos = 0, start, end;
+	gint count = 0;
+	
+	while (text_search_find_text(ts, text, len, pos, &start, &end)) {
+		pos = end;
+		count++;
+	}
+	text_search_unref(ts);
+	
+	return count;
+}
+
+static gdouble run(gint (*func)(const gchar *, const gchar *),
+	const gchar *text, const gchar *needle, gint *count)
+{
+	GTimer *timer = g_timer_new();
+	gdouble best = G_MAXDOUBLE;
+	gint i;
+	
+	for (i = 0; i < BENCH_RUNS; i++) {
+		g_timer_start(timer);
+		*count = func(text, needle);
+		best = MIN(best, g_timer_elapsed(timer, NULL));
+	}
+	g_timer_destroy(timer);
+	
+	return best * 1000;
+}
+
+static void report(const gchar *name, const gchar *text, const gchar *needle)
+{
+	gint n_old, n_new;
+	gdouble t_old = run(count_old, text, needle, &n_old);
+	gdouble t_new = run(count_new, text, needle, &n_new);
+	
+	g_print("%-22s %9.1f %8.1f %7.1fx %8d %8d\n",
+		name, t_old, t_new, t_old / t_new, n_old, n_new);
+}
+
+gint main(void)
+{
+	gchar *log = make_text(log_words, G_N_ELEMENTS(log_words));
+	gchar *mixed = make_text(mixed_words, G_N_ELEMENTS(mixed_words));
+	
+#ifdef __SSE2__
+	g_print("SSE2 filter\n");
+#else
+	g_print("no SSE2 filter\n");
+#endif
+	g_print("%-22s %9s %8s %8s %8s %8s\n",
+		"", "old ms", "new ms", "", "old hits", "new hits");
+	report("log, \"error\"", log, "error");
+	report("log, \"Worker-7 Queue\"", log, "Worker-7 Queue");
+	report("mixed, \"ERROR\"", mixed, "ERROR");
+	report("mixed, kana needle", mixed, "ファイル");
+	g_free(log);
+	g_free(mixed);
+	
+	return 0;
+}
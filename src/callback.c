@@ -83,7 +83,6 @@ void on_file_open(void)
 		else {
 			g_free(pub->fi);
 			pub->fi = fi;
-			undo_clear_all(pub->mw->buffer);
 //			set_main_window_title();
 			force_call_cb_modified_changed(pub->mw->view);
 //			undo_init(sd->mainwin->textview, sd->mainwin->textbuffer, sd->mainwin->menubar);
@@ -119,7 +118,6 @@ gint on_file_save_as(void)
 	}
 	g_free(pub->fi);
 	pub->fi = fi;
-	undo_clear_all(pub->mw->buffer);
 //	set_main_window_title();
 	force_call_cb_modified_changed(pub->mw->view);
 //	undo_init(sd->mainwin->textview, sd->mainwin->textbuffer, sd->mainwin->menubar);
@@ -145,32 +143,51 @@ void on_file_print(void)
 }
 #	endif
 #endif
+static void file_close_real(void)
+{
+	force_block_cb_modified_changed(pub->mw->view);
+//	undo_block_signal(textbuffer);
+	gtk_text_buffer_set_text(pub->mw->buffer, "", 0);
+	gtk_text_buffer_set_modified(pub->mw->buffer, FALSE);
+	if (pub->fi->filename)
+		g_free(pub->fi->filename);
+	pub->fi->filename = NULL;
+	if (pub->fi->charset)
+		g_free(pub->fi->charset);
+	pub->fi->charset = NULL;
+	pub->fi->charset_flag = FALSE;
+	pub->fi->lineend = LF;
+	undo_clear_all(pub->mw->buffer);
+//	set_main_window_title();
+	force_call_cb_modified_changed(pub->mw->view);
+	force_unblock_cb_modified_changed(pub->mw->view);
+//	undo_unblock_signal(textbuffer);
+//	undo_init(sd->mainwin->textview, textbuffer, sd->mainwin->menubar);
+}
+
 void on_file_close(void)
 {
 	if (!check_text_modification()) {
-		force_block_cb_modified_changed(pub->mw->view);
-//		undo_block_signal(textbuffer);
-		gtk_text_buffer_set_text(pub->mw->buffer, "", 0);
-		gtk_text_buffer_set_modified(pub->mw->buffer, FALSE);
-		if (pub->fi->filename)
-			g_free(pub->fi->filename);
-		pub->fi->filename = NULL;
-		if (pub->fi->charset)
-			g_free(pub->fi->charset);
-		pub->fi->charset = NULL;
-		pub->fi->charset_flag = FALSE;
-		pub->fi->lineend = LF;
-		undo_clear_all(pub->mw->buffer);
-//		set_main_window_title();
-		force_call_cb_modified_changed(pub->mw->view);
-		force_unblock_cb_modified_changed(pub->mw->view);
-//		undo_unblock_signal(textbuffer);
-//		undo_init(sd->mainwin->textview, textbuffer, sd->mainwin->menubar);
+		file_open_cancel();
+		file_close_real();
 	}
 }
 
+/* a partly loaded file must not be saved over the original */
+void on_file_progress_cancel(void)
+{
+	if (file_save_in_progress()) {
+		file_save_cancel();
+		return;
+	}
+	file_open_cancel();
+	file_close_real();
+}
+
 void on_file_quit(void)
 {
+	if (file_save_in_progress())
+		return;
 	if (!check_text_modification()) {
 		save_config_file();
 		gtk_main_quit();
@@ -187,6 +204,16 @@ void on_edit_redo(void)
 	undo_redo(pub->mw->buffer);
 }
 
+void on_edit_older_branch(void)
+{
+	undo_branch_older(pub->mw->buffer);
+}
+
+void on_edit_newer_branch(void)
+{
+	undo_branch_newer(pub->mw->buffer);
+}
+
 void on_edit_cut(void)
 {
 	g_signal_emit_by_name(G_OBJECT(pub->mw->view), "cut-clipboard");
@@ -276,6 +303,16 @@ void on_search_replace(void)
 		activate_quick_find();
 }
 
+void on_search_find_in_files(void)
+{
+	run_dialog_find_in_files(pub->mw->view, 0);
+}
+
+void on_search_replace_in_files(void)
+{
+	run_dialog_find_in_files(pub->mw->view, 1);
+}
+
 void on_search_jump_to(void)
 {
 	run_dialog_jump_to(pub->mw->view);
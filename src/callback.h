@@ -27,9 +27,12 @@ gint on_file_save_as(void);
 void on_file_print_preview(void);
 void on_file_print(void);
 void on_file_close(void);
+void on_file_progress_cancel(void);
 void on_file_quit(void);
 void on_edit_undo(void);
 void on_edit_redo(void);
+void on_edit_older_branch(void);
+void on_edit_newer_branch(void);
 void on_edit_cut(void);
 void on_edit_copy(void);
 void on_edit_paste(void);
@@ -43,6 +46,8 @@ void on_search_find(void);
 void on_search_find_next(void);
 void on_search_find_previous(void);
 void on_search_replace(void);
+void on_search_find_in_files(void);
+void on_search_replace_in_files(void);
 void on_search_jump_to(void);
 void on_option_font(void);
 void on_option_word_wrap(void);
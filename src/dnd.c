@@ -73,7 +73,6 @@ static void dnd_open_first_file(gchar *filename)
 	else {
 		g_free(pub->fi);
 		pub->fi = fi;
-		undo_clear_all(pub->mw->buffer);
 		set_main_window_title();
 //		undo_init(sd->mainwin->textview, sd->mainwin->textbuffer, sd->mainwin->menubar);
 	}
@@ -18,7 +18,9 @@
  */
 
 #include <glib.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "encoding.h"
 
 #define MAX_COUNTRY_NUM 10
@@ -147,338 +149,693 @@ const gchar *get_default_charset(void)
 }
 
 /*
-Imported from KEdit (for BeOS, NOT KDE).
-based on
-http://examples.oreilly.com/cjkvinfo/Ch7/DetectCodeType.c
-*/
-void convert_line_ending_to_lf(gchar *text)
+ * The scans below step over a block of VECTOR_BLOCK bytes at a time where
+ * the target supports it, and fall back to plain byte loops elsewhere.
+ */
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#	define VECTOR_BLOCK 32
+
+static inline guint32 vector_match_mask(const gchar *p, gchar c)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+/* bytes >= 0x80, and those in the C1 range 0x80-0x9F */
+static inline void vector_high_masks(const gchar *p, guint32 *high, guint32 *c1)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	__m256i top = _mm256_and_si256(v, _mm256_set1_epi8((gchar) 0xE0));
+	
+	*high = _mm256_movemask_epi8(v);
+	*c1 = _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(top, _mm256_set1_epi8((gchar) 0x80)));
+}
+#elif defined(__SSE2__)
+#	include <emmintrin.h>
+#	define VECTOR_BLOCK 16
+
+static inline guint32 vector_match_mask(const gchar *p, gchar c)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static inline void vector_high_masks(const gchar *p, guint32 *high, guint32 *c1)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	__m128i top = _mm_and_si128(v, _mm_set1_epi8((gchar) 0xE0));
+	
+	*high = _mm_movemask_epi8(v);
+	*c1 = _mm_movemask_epi8(_mm_cmpeq_epi8(top, _mm_set1_epi8((gchar) 0x80)));
+}
+#endif
+
+#ifdef VECTOR_BLOCK
+/* bytes below the lowest set bit of mask, and the mask of those bytes */
+#	define LINE_END_SPAN(mask) \
+		((mask) ? (guint) __builtin_ctz(mask) : VECTOR_BLOCK)
+#	define LINE_END_BELOW(n) ((n) < 32 ? (1U << (n)) - 1 : 0xFFFFFFFFU)
+#endif
+
+/*
+ * Line endings: blocks without a CR (or, writing out, without an LF) are
+ * handled a vector at a time; only the bytes around a line break take the
+ * scalar path.
+ *
+ * Counts the line endings of a counted chunk of a larger stream and, if
+ * convert is set, rewrites them in place as LF. A CR at the very end of
+ * the chunk is written as LF and left pending, so that an LF starting the
+ * next chunk is dropped. Returns the new length of the chunk.
+ */
+static gsize line_end_scan(gchar *text, gsize len, LineEndStats *stats,
+	gboolean convert)
 {
-	gint i, j;
+	gsize i = 0, j = 0;
 	
-	for (i = 0, j = 0; TRUE; i++, j++) {
-		if (*(text + i) == CR) {
-			*(text + j) = LF;
-			if (*(text + i + 1) == LF)
+	if (stats->cr_pending && len) {
+		if (text[0] == LF) {
+			stats->crlf++;
+			i++;
+		} else
+			stats->cr++;
+		stats->cr_pending = FALSE;
+	}
+	while (i < len) {
+#ifdef VECTOR_BLOCK
+		while (i + VECTOR_BLOCK <= len) {
+			guint32 cr = vector_match_mask(text + i, CR);
+			guint n = LINE_END_SPAN(cr);
+			
+			stats->lf += __builtin_popcount(
+				vector_match_mask(text + i, LF) & LINE_END_BELOW(n));
+			if (convert && i != j)
+				memmove(text + j, text + i, n);
+			i += n;
+			j += n;
+			if (cr)
+				break;
+		}
+		if (i == len)
+			break;
+#endif
+		if (text[i] == CR) {
+			if (convert)
+				text[j] = LF;
+			if (i + 1 == len)
+				stats->cr_pending = TRUE;
+			else if (text[i + 1] == LF) {
+				stats->crlf++;
 				i++;
+			} else
+				stats->cr++;
 		} else {
-			*(text + j) = *(text + i);
-			if (*(text + j) == '\0')
+			if (text[i] == LF)
+				stats->lf++;
+			if (convert)
+				text[j] = text[i];
+		}
+		i++;
+		j++;
+	}
+	
+	return j;
+}
+
+gsize convert_line_ending_to_lf_len(gchar *text, gsize len,
+	LineEndStats *stats)
+{
+	return line_end_scan(text, len, stats, TRUE);
+}
+
+void count_line_endings(const gchar *text, gsize len, LineEndStats *stats)
+{
+	line_end_scan((gchar *) text, len, stats, FALSE);
+}
+
+/* call once the whole stream has been seen */
+void line_end_stats_finish(LineEndStats *stats)
+{
+	if (stats->cr_pending) {
+		stats->cr++;
+		stats->cr_pending = FALSE;
+	}
+}
+
+gboolean line_end_stats_mixed(const LineEndStats *stats)
+{
+	return (stats->lf != 0) + (stats->crlf != 0) + (stats->cr != 0) > 1;
+}
+
+/* the most common line ending, or fallback if there are none */
+gint line_end_stats_major(const LineEndStats *stats, gint fallback)
+{
+	if (!stats->lf && !stats->crlf && !stats->cr)
+		return fallback;
+	if (stats->lf >= stats->crlf && stats->lf >= stats->cr)
+		return LF;
+	if (stats->crlf >= stats->cr)
+		return CR+LF;
+	return CR;
+}
+
+/*
+ * Writes text with each LF replaced by retcode into out, which must have
+ * room for twice len bytes in the CR+LF case. Returns the length written.
+ */
+gsize convert_line_ending_from_lf(const gchar *text, gsize len, gchar *out,
+	gint retcode)
+{
+	gsize i = 0, j = 0;
+	
+	while (i < len) {
+#ifdef VECTOR_BLOCK
+		while (i + VECTOR_BLOCK <= len) {
+			guint32 lf = vector_match_mask(text + i, LF);
+			guint n = LINE_END_SPAN(lf);
+			
+			if (out + j != text + i)
+				memcpy(out + j, text + i, n);
+			i += n;
+			j += n;
+			if (lf)
 				break;
 		}
+		if (i == len)
+			break;
+#endif
+		if (text[i] == LF) {
+			if (retcode != LF)
+				out[j++] = CR;
+			if (retcode != CR)
+				out[j++] = LF;
+		} else
+			out[j++] = text[i];
+		i++;
 	}
+	
+	return j;
+}
+
+void convert_line_ending_to_lf(gchar *text)
+{
+	LineEndStats stats = { 0, 0, 0, FALSE };
+	gsize len;
+	
+	len = convert_line_ending_to_lf_len(text, strlen(text), &stats);
+	text[len] = '\0';
 }
 
 void convert_line_ending(gchar **text, gint retcode)
 {
 	gchar *buf, *str = *text;
-	const gint len = strlen(str);
-	gint i, j, LFNum = 0;
+	const gsize len = strlen(str);
+	gsize n;
 	
 	switch (retcode) {
 	case CR:
-		while (*str != '\0') {
-			if (*str == LF)
-				*str = CR;
-			str++;
-		}
+		convert_line_ending_from_lf(str, len, str, CR);
 		break;
 	case CR+LF:
-		for (i = 0; *(str + i) != '\0'; i++) {
-			if (*(str + i) == LF)
-				LFNum++;
-		}
-		buf = g_new(gchar, len + LFNum + 1);
-		for (i= 0, j = 0;; i++, j++) {
-			if (*(str + j) == LF) {
-				*(buf + i) = CR;
-				*(buf + (++i)) = LF;
-			} else
-				*(buf + i) = *(str + j);
-			if (*(str + j) == '\0')
-				break;
-		}
+		buf = g_new(gchar, len * 2 + 1);
+		n = convert_line_ending_from_lf(str, len, buf, CR+LF);
+		buf[n] = '\0';
 		g_free(*text);
-		*text = buf;
+		*text = g_renew(gchar, buf, n + 1);
 	}
 }
 
 gint detect_line_ending(const gchar *text)
 {
-	while (*(text++) != '\0') {
-		if (*text == LF)
-			break;
-		if (*text == CR) {
-			if (*(++text) == LF)
-				return CR+LF;
-			else
-				return CR;
-		}
-	}
-	return LF;
+	LineEndStats stats = { 0, 0, 0, FALSE };
+	
+	count_line_endings(text, strlen(text), &stats);
+	line_end_stats_finish(&stats);
+	
+	return line_end_stats_major(&stats, LF);
 }
 
-static const gchar *detect_charset_cylillic(const gchar *text)
+/* length of the well-formed UTF-8 sequence at p, or 0 */
+static gsize utf8_sequence_length(const guint8 *p, const guint8 *end)
 {
-	guint8 c = *text;
-	gboolean noniso = FALSE;
-	guint32 xc = 0, xd = 0, xef = 0;
+	guint8 lo = 0x80, hi = 0xBF;
+	gsize i, n;
 	
-	const gchar *charset = get_encoding_items(get_encoding_code())->item[OPENI18N];
+	if (*p >= 0xC2 && *p <= 0xDF)
+		n = 2;
+	else if (*p >= 0xE0 && *p <= 0xEF) {
+		n = 3;
+		if (*p == 0xE0)
+			lo = 0xA0;	/* overlong */
+		else if (*p == 0xED)
+			hi = 0x9F;	/* surrogates */
+	} else if (*p >= 0xF0 && *p <= 0xF4) {
+		n = 4;
+		if (*p == 0xF0)
+			lo = 0x90;	/* overlong */
+		else if (*p == 0xF4)
+			hi = 0x8F;	/* above U+10FFFF */
+	} else
+		return 0;
 	
-	while ((c = *text++) != '\0') {
-		if (c >= 0x80 && c <= 0x9F)
-			noniso = TRUE;
-		else if (c >= 0xC0 && c <= 0xCF)
-			xc++;
-		else if (c >= 0xD0 && c <= 0xDF)
-			xd++;
-		else if (c >= 0xE0)
-			xef++;
-	}
-	
-	if (!noniso && ((xc + xef) < xd))
-		charset = "ISO-8859-5";
-	else if ((xc + xd) < xef)
-		charset = "CP1251";
+	if ((gsize) (end - p) < n || p[1] < lo || p[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++)
+		if (p[i] < 0x80 || p[i] > 0xBF)
+			return 0;
 	
-	return charset;
+	return n;
 }
 
-static const gchar *detect_charset_chinese(const gchar *text)
+/*
+ * Classifies text in a single pass, for every detector to share. C1 bytes
+ * are only looked for once the text is known not to be UTF-8, and it stops
+ * early once it is found to hold one, as nothing else is asked of such text.
+ */
+guint classify_text(const gchar *text, gsize len)
 {
-	guint8 c = *text;
-	
-	const gchar *charset = get_encoding_items(get_encoding_code())->item[IANA];
+	const guint8 *p = (const guint8 *) text, *end = p + len, *stop;
+	guint flags = TEXT_ASCII | TEXT_UTF8;
+	gsize n;
 	
-	while ((c = *text++) != '\0') {
-		if (c >= 0x81 && c <= 0x87) {
-			charset = "GB18030";
-			break;
-		}
-		else if (c >= 0x88 && c <= 0xA0) {
-			c = *text++;
-			if ((c >= 0x30 && c <= 0x39) || (c >= 0x80 && c <= 0xA0)) {
-				charset = "GB18030";
+	while (p < end) {
+		stop = end;
+#ifdef VECTOR_BLOCK
+		while (p + VECTOR_BLOCK <= end) {
+			guint32 high, c1;
+			
+			if (vector_match_mask((const gchar *) p, 0x1B))
+				flags |= TEXT_HAS_ESC;
+			vector_high_masks((const gchar *) p, &high, &c1);
+			if (high && (flags & TEXT_UTF8))
 				break;
-			} //else GBK/Big5-HKSCS cannot determine
+			/* past the UTF-8 check, so no continuation byte is taken */
+			if (c1)
+				flags |= TEXT_HAS_C1;
+			if (high)
+				flags &= ~TEXT_ASCII;
+			if ((flags & (TEXT_UTF8 | TEXT_HAS_C1)) == TEXT_HAS_C1)
+				return flags;
+			p += VECTOR_BLOCK;
 		}
-		else if ((c >= 0xA1 && c <= 0xC6) || (c >= 0xC9 && c <= 0xF9)) {
-			c = *text++;
-			if (c >= 0x40 && c <= 0x7E)
-				charset = "BIG5";
-			else if ((c >= 0x30 && c <= 0x39) || (c >= 0x80 && c <= 0xA0)) {
-				charset = "GB18030";
-				break;
+		/* validate this block a byte at a time, then try vectors again */
+		stop = MIN(p + VECTOR_BLOCK, end);
+#endif
+		while (p < stop) {
+			if (*p == 0x1B)
+				flags |= TEXT_HAS_ESC;
+			if (*p < 0x80) {
+				p++;
+				continue;
 			}
-		}
-		else if (c >= 0xC7) {
-			c = *text++;
-			if ((c >= 0x30 && c <= 0x39) || (c >= 0x80 && c <= 0xA0)) {
-				charset = "GB18030";
-				break;
+			flags &= ~TEXT_ASCII;
+			if ((flags & TEXT_UTF8) && (n = utf8_sequence_length(p, end))) {
+				p += n;
+				continue;
 			}
+			flags &= ~TEXT_UTF8;
+			if (*p <= 0x9F)
+				flags |= TEXT_HAS_C1;
+			if (flags & TEXT_HAS_C1)
+				return flags;
+			p++;
 		}
 	}
 	
-	return charset;
+	return flags;
 }
 
-static const gchar *detect_charset_japanese(const gchar *text)
+/*
+ * Legacy charsets are told apart by decoding a bounded sample with every
+ * candidate and scoring how much the result looks like text: characters
+ * that never occur in text cost a lot, neighbouring letters of one script
+ * (or Latin letters next to ASCII ones) gain, while letters of unrelated
+ * scripts side by side, symbols stuck to letters and case flips inside
+ * words lose. Lowercase letters gain a little, as text is mostly
+ * lowercase. Han characters are weighed by a short list of the most
+ * frequent ones, which is what sets the CJK charsets apart when all of
+ * them decode the sample.
+ */
+#define CHARSET_SAMPLE_SIZE	(16 * 1024)
+#define CHARSET_LOCALE_BONUS	0.3
+#define CHARSET_MAX_CANDIDATES	48
+
+enum {
+	CHAR_OTHER = 0,	/* digits, punctuation, symbols, spaces */
+	CHAR_BAD,	/* never seen in real text */
+	CHAR_SYMBOL,
+	CHAR_ASCII,
+	CHAR_LATIN,
+	CHAR_GREEK,
+	CHAR_CYRILLIC,
+	CHAR_HEBREW,
+	CHAR_ARABIC,
+	CHAR_THAI,
+	CHAR_GEORGIAN,
+	CHAR_HANGUL,
+	CHAR_KANA,
+	CHAR_HALF_KANA,
+	CHAR_HAN,
+	CHAR_LETTER	/* any other script */
+};
+
+static const struct {
+	gunichar first, last;
+	gint class;
+} char_ranges[] = {
+	{ 0x00C0, 0x024F, CHAR_LATIN },
+	{ 0x0370, 0x03FF, CHAR_GREEK },
+	{ 0x0400, 0x052F, CHAR_CYRILLIC },
+	{ 0x0590, 0x05FF, CHAR_HEBREW },
+	{ 0x0600, 0x06FF, CHAR_ARABIC },
+	{ 0x0E00, 0x0E7F, CHAR_THAI },
+	{ 0x10A0, 0x10FF, CHAR_GEORGIAN },
+	{ 0x1100, 0x11FF, CHAR_HANGUL },
+	{ 0x1E00, 0x1EFF, CHAR_LATIN },
+	{ 0x3040, 0x30FF, CHAR_KANA },
+	{ 0x3130, 0x318F, CHAR_HANGUL },
+	{ 0x3400, 0x4DBF, CHAR_HAN },
+	{ 0x4E00, 0x9FFF, CHAR_HAN },
+	{ 0xAC00, 0xD7A3, CHAR_HANGUL },
+	{ 0xFF66, 0xFF9F, CHAR_HALF_KANA },
+};
+
+/* most frequent Han characters in Chinese (both forms) and Japanese */
+static const gchar common_han_chars[] =
+	"的一是不了在人有我他这个们中来上大为和国地到以说时要就出会可也你"
+	"对生能而子那得于着下自之年过发后作里用道行所然家种事成方多经么去"
+	"法学如都同现当没动面起看定天分还进好小部其些主样理心她本前开但因"
+	"只从想实日這個們來為國說時會對發後裡種經麼學現當沒動麵還進樣開從"
+	"實見長問關點電業無與體產東頭機間記話門私物気言思手何今彼女新聞社"
+	"者合入立場円月書内名連外高持野結市";
+
+/* charsets detected outside of encoding_table */
+static const gchar *extra_charsets[] = { "CP1361", NULL };
+
+static gint compare_unichar(gconstpointer a, gconstpointer b)
 {
-	guint8 c = *text;
-	gchar *charset = NULL;
+	gunichar x = *(const gunichar *) a, y = *(const gunichar *) b;
 	
-	while (charset == NULL && (c = *text++) != '\0') {
-		if (c >= 0x81 && c <= 0x9F) {
-			if (c == 0x8E) /* SS2 */ {
-				c = *text++;
-				if ((c >= 0x40 && c <= 0xA0) || (c >= 0xE0 && c <= 0xFC))
-					charset = "CP932";
-			}
-			else if (c == 0x8F) /* SS3 */ {
-				c = *text++;
-				if (c >= 0x40 && c <= 0xA0)
-					charset = "CP932";
-				else if (c >= 0xFD)
-					break;
-			}
-			else
-				charset = "CP932";
-		}
-		else if (c >= 0xA1 && c <= 0xDF) {
-			c = *text++;
-			if (c <= 0x9F)
-				charset = "CP932";
-			else if (c >= 0xFD)
-				break;
-		}
-		else if (c >= 0xE0 && c <= 0xEF) {
-			c = *text++;
-			if (c >= 0x40 && c <= 0xA0)
-				charset = "CP932";
-			else if (c >= 0xFD)
-				break;
+	return x < y ? -1 : x > y;
+}
+
+static glong common_han_num;
+
+static gpointer common_han_table_init(gpointer data)
+{
+	gunichar *table;
+	
+	table = g_utf8_to_ucs4_fast(common_han_chars, -1, &common_han_num);
+	qsort(table, common_han_num, sizeof(gunichar), compare_unichar);
+	
+	return table;
+}
+
+/* detection runs in the loader and search threads too */
+static gboolean is_common_han(gunichar c)
+{
+	static GOnce once = G_ONCE_INIT;
+	gunichar *table;
+	
+	table = g_once(&once, common_han_table_init, NULL);
+	
+	return bsearch(&c, table, common_han_num, sizeof(gunichar),
+		compare_unichar) != NULL;
+}
+
+static gint get_char_class(gunichar c)
+{
+	guint i;
+	
+	if (c < 0x80) {
+		if (g_ascii_isalpha(c))
+			return CHAR_ASCII;
+		return g_ascii_iscntrl(c) && !g_ascii_isspace(c) ? CHAR_BAD : CHAR_OTHER;
+	}
+	switch (g_unichar_type(c)) {
+	case G_UNICODE_CONTROL:
+	case G_UNICODE_PRIVATE_USE:
+	case G_UNICODE_UNASSIGNED:
+	case G_UNICODE_SURROGATE:
+		return CHAR_BAD;
+	default:
+		break;
+	}
+	if (c == 0xFFFD)
+		return CHAR_BAD;
+	if (!g_unichar_isalpha(c)) {
+		switch (g_unichar_type(c)) {
+		case G_UNICODE_CURRENCY_SYMBOL:
+		case G_UNICODE_MATH_SYMBOL:
+		case G_UNICODE_MODIFIER_SYMBOL:
+		case G_UNICODE_OTHER_SYMBOL:
+		case G_UNICODE_OTHER_NUMBER:
+			return CHAR_SYMBOL;
+		default:
+			return CHAR_OTHER;
 		}
-		else if (c >= 0xF0)
-			break;
 	}
+	for (i = 0; i < G_N_ELEMENTS(char_ranges); i++)
+		if (c >= char_ranges[i].first && c <= char_ranges[i].last)
+			return char_ranges[i].class;
 	
-	if (charset == NULL)
-		charset = "EUC-JP";
+	return CHAR_LETTER;
+}
+
+static gdouble get_char_weight(gunichar c, gint class)
+{
+	switch (class) {
+	case CHAR_BAD:
+		return -5;
+	case CHAR_HALF_KANA:
+		return -0.3;
+	case CHAR_HAN:
+		return is_common_han(c) ? 1.5 : -0.3;
+	case CHAR_HANGUL:
+		return 0.3;
+	}
+	return g_unichar_islower(c) ? 0.5 : 0;
+}
+
+static gdouble get_pair_weight(gunichar a, gint ca, gunichar b, gint cb)
+{
+	if (ca <= CHAR_BAD || cb <= CHAR_BAD)
+		return 0;
+	if (ca == CHAR_SYMBOL || cb == CHAR_SYMBOL)
+		return ca == cb ? 0 : -1;
+	if (g_unichar_islower(a) && g_unichar_isupper(b))
+		return -1;
+	if (ca == CHAR_LATIN || cb == CHAR_LATIN) {
+		if (ca == CHAR_ASCII || cb == CHAR_ASCII)
+			return 1;
+		if (ca == cb)
+			return -0.5;
+	}
+	if (ca == cb)
+		return ca == CHAR_HALF_KANA ? 0 : 1;
+	if ((ca == CHAR_KANA && cb == CHAR_HAN)
+		|| (ca == CHAR_HAN && cb == CHAR_KANA))
+		return 1;
 	
-	return charset;
+	return -2;
 }
 
-static const gchar *detect_charset_korean(const gchar *text)
+/* mean score per non-ASCII character */
+static gdouble score_decoded_text(const gchar *text, gsize len)
 {
-	guint8 c = *text;
-	gboolean noneuc = FALSE;
-	gboolean nonjohab = FALSE;
-	gchar *charset = NULL;
+	const gchar *p, *end = text + len;
+	gunichar c, prev = ' ';
+	gint class, prev_class = CHAR_OTHER;
+	gdouble score = 0;
+	gsize num = 0;
 	
-	while (charset == NULL && (c = *text++) != '\0') {
-		if (c >= 0x81 && c < 0x84) {
-			charset = "CP949";
-		}
-		else if (c >= 0x84 && c < 0xA1) {
-			noneuc = TRUE;
-			c = *text++;
-			if ((c > 0x5A && c < 0x61) || (c > 0x7A && c < 0x81))
-				charset = "CP1361";
-			else if (c == 0x52 || c == 0x72 || c == 0x92 || (c > 0x9D && c < 0xA1)
-				|| c == 0xB2 || (c > 0xBD && c < 0xC1) || c == 0xD2
-				|| (c > 0xDD && c < 0xE1) || c == 0xF2 || c == 0xFE)
-				charset = "CP949";
-		}
-		else if (c >= 0xA1 && c <= 0xC6) {
-			c = *text++;
-			if (c < 0xA1) {
-				noneuc = TRUE;
-				if ((c > 0x5A && c < 0x61) || (c > 0x7A && c < 0x81))
-					charset = "CP1361";
-				else if (c == 0x52 || c == 0x72 || c == 0x92 || (c > 0x9D && c < 0xA1))
-					charset = "CP949";
-				else if (c == 0xB2 || (c > 0xBD && c < 0xC1) || c == 0xD2
-					|| (c > 0xDD && c < 0xE1) || c == 0xF2 || c == 0xFE)
-					nonjohab = TRUE;
-			}
-		}
-		else if (c > 0xC6 && c <= 0xD3) {
-			c = *text++;
-			if (c < 0xA1)
-				charset = "CP1361";
-		}
-		else if (c > 0xD3 && c < 0xD8) {
-			nonjohab = TRUE;
-			c = *text++;
-		}
-		else if (c >= 0xD8) {
-			c = *text++;
-			if (c < 0xA1)
-				charset = "CP1361";
+	for (p = text; p < end; p = g_utf8_next_char(p)) {
+		c = g_utf8_get_char(p);
+		class = get_char_class(c);
+		if (c >= 0x80) {
+			num++;
+			score += get_char_weight(c, class);
 		}
-		if (noneuc && nonjohab)
-			charset = "CP949";
+		if (c >= 0x80 || prev >= 0x80)
+			score += get_pair_weight(prev, prev_class, c, class);
+		prev = c;
+		prev_class = class;
 	}
 	
-	if (charset == NULL) {
-		if (noneuc)
-			charset = "CP949";
-		else
-			charset = "EUC-KR";
+	return num ? score / num : 0;
+}
+
+/* an incomplete sequence at the end of the sample is not an error */
+static gchar *decode_sample(const gchar *charset, const gchar *text, gsize len,
+	gsize *outlen)
+{
+	GIConv cd;
+	gchar *in = (gchar *) text, *buf, *out;
+	gsize inleft = len, outleft = len * 4 + 4, res;
+	
+	cd = g_iconv_open("UTF-8", charset);
+	if (cd == (GIConv) -1)
+		return NULL;
+	buf = out = g_malloc(outleft);
+	res = g_iconv(cd, &in, &inleft, &out, &outleft);
+	if (res == (gsize) -1 && errno != EINVAL) {
+		g_free(buf);
+		buf = NULL;
 	}
+	g_iconv_close(cd);
+	*outlen = out - buf;
 	
-	return charset;
+	return buf;
+}
+
+static gint add_candidate(CharsetCandidate *cands, gint num,
+	const gchar *charset, gdouble bonus)
+{
+	gint i;
+	
+	if (!charset || g_str_has_prefix(charset, "ISO-2022")
+		|| g_ascii_strcasecmp(charset, "UTF-8") == 0
+		|| num == CHARSET_MAX_CANDIDATES)
+		return num;
+	for (i = 0; i < num; i++)
+		if (g_ascii_strcasecmp(cands[i].charset, charset) == 0)
+			return num;
+	cands[num].charset = charset;
+	cands[num].confidence = bonus;
+	
+	return num + 1;
 }
 
-static gboolean detect_noniso(const gchar *text)
+/*
+ * Returns the legacy charsets that can decode the start of text, most
+ * likely first, with confidences adding up to 1 (or all 0 if none of them
+ * looks like text). The locale's own charsets are preferred on close calls.
+ * flags are what classify_text() made of text. Free the result with g_free().
+ */
+CharsetCandidate *detect_charset_candidates(const gchar *text, gsize len,
+	guint flags, gint *num)
 {
-	guint8 c = *text;
+	CharsetCandidate *cands;
+	const gchar *const *row;
+	gchar *decoded;
+	gsize outlen;
+	gdouble total = 0;
+	guint code, i, j;
+	gint n = 0;
+	
+	len = MIN(len, CHARSET_SAMPLE_SIZE);
+	code = get_encoding_code();
+	
+	cands = g_new(CharsetCandidate, CHARSET_MAX_CANDIDATES);
+	n = add_candidate(cands, n, get_default_charset(), CHARSET_LOCALE_BONUS);
+	for (j = 0; j < ENCODING_MAX_ITEM_NUM; j++)
+		n = add_candidate(cands, n, encoding_table[code][j], CHARSET_LOCALE_BONUS);
+	for (i = 0; i < END_CODE; i++)
+		for (j = 0; j < ENCODING_MAX_ITEM_NUM; j++)
+			n = add_candidate(cands, n, encoding_table[i][j], 0);
+	for (row = extra_charsets; *row; row++)
+		n = add_candidate(cands, n, *row, 0);
+	
+	for (i = 0, j = 0; i < (guint) n; i++) {
+		/* C1 bytes decode to control characters in ISO-8859 */
+		if ((flags & TEXT_HAS_C1) && g_str_has_prefix(cands[i].charset, "ISO-8859"))
+			continue;
+		decoded = decode_sample(cands[i].charset, text, len, &outlen);
+		if (!decoded)
+			continue;
+		cands[j].charset = cands[i].charset;
+		cands[j].confidence = MAX(0,
+			score_decoded_text(decoded, outlen) + cands[i].confidence);
+		total += cands[j].confidence;
+		j++;
+		g_free(decoded);
+	}
+	n = j;
 	
-	while ((c = *text++) != '\0') {
-		if (c >= 0x80 && c <= 0x9F)
-			return TRUE;
+	for (i = 0; i < (guint) n; i++)
+		cands[i].confidence = total > 0 ? cands[i].confidence / total : 0;
+	/* stable, so that the locale's charsets win ties */
+	for (i = 1; i < (guint) n; i++) {
+		CharsetCandidate tmp = cands[i];
+		
+		for (j = i; j > 0 && cands[j - 1].confidence < tmp.confidence; j--)
+			cands[j] = cands[j - 1];
+		cands[j] = tmp;
 	}
-	return FALSE;
+	
+	*num = n;
+	return cands;
 }
 
-const gchar *detect_charset(const gchar *text)
+/* only called on 7-bit text; NULL if no ISO-2022 designation decides */
+static const gchar *detect_charset_iso2022(const gchar *text)
 {
-	guint8 c = *text;
+	guint8 c;
 	const gchar *charset = NULL;
 	
-	if (g_utf8_validate(text, -1, NULL)) {
-		while ((c = *text++) != '\0') {
-			if (c > 0x7F) {
-				charset = "UTF-8";
+	while ((text = strchr(text, 0x1B)) != NULL) /* ESC */ {
+		text++;
+		c = *text++;
+		if (c == '$') {
+			c = *text++;
+			switch (c) {
+			case 'B': // JIS X 0208-1983
+			case '@': // JIS X 0208-1978
+				charset = "ISO-2022-JP";
+				continue;
+			case 'A': // GB2312-1980
+				charset = "ISO-2022-JP-2";
 				break;
-			}
-			if (c == 0x1B) /* ESC */ {
+			case '(':
 				c = *text++;
-				if (c == '$') {
-					c = *text++;
-					switch (c) {
-					case 'B': // JIS X 0208-1983
-					case '@': // JIS X 0208-1978
-						charset = "ISO-2022-JP";
-						continue;
-					case 'A': // GB2312-1980
-						charset = "ISO-2022-JP-2";
-						break;
-					case '(':
-						c = *text++;
-						switch (c) {
-						case 'C': // KSC5601-1987
-						case 'D': // JIS X 0212-1990
-							charset = "ISO-2022-JP-2";
-						}
-						break;
-					case ')':
-						c = *text++;
-						if (c == 'C')
-							charset = "ISO-2022-KR"; // KSC5601-1987
-					}
-					break;
+				switch (c) {
+				case 'C': // KSC5601-1987
+				case 'D': // JIS X 0212-1990
+					charset = "ISO-2022-JP-2";
 				}
+				break;
+			case ')':
+				c = *text++;
+				if (c == 'C')
+					charset = "ISO-2022-KR"; // KSC5601-1987
 			}
+			break;
 		}
+		if (c == '\0')
+			break;
+	}
+	
+	return charset;
+}
+
+const gchar *detect_charset(const gchar *text)
+{
+	const gchar *charset = NULL;
+	guint flags;
+	
+	flags = classify_text(text, strlen(text));
+	if (flags & TEXT_UTF8) {
+		if (!(flags & TEXT_ASCII))
+			charset = "UTF-8";
+		else if (flags & TEXT_HAS_ESC)
+			charset = detect_charset_iso2022(text);
 		if (!charset)
 			charset = get_default_charset();
 	}
 	
 	if (!charset) {
-		switch (get_encoding_code()) {
-		case LATINC:
-		case LATINC_UA:
-		case LATINC_TJ:
-			charset = detect_charset_cylillic(text); // fuzzy...
-			break;
-		case CHINESE_CN:
-		case CHINESE_TW:
-		case CHINESE_HK:
-			charset = detect_charset_chinese(text);
-			break;
-		case JAPANESE:
-			charset = detect_charset_japanese(text);
-			break;
-		case KOREAN:
-			charset = detect_charset_korean(text);
-			break;
-		case VIETNAMESE:
-		case THAI:
-		case GEORGIAN:
-			charset = get_encoding_items(get_encoding_code())->item[OPENI18N];
-			break;
-		default:
-			if (strcmp(get_default_charset(), "UTF-8") != 0)
-				charset = get_default_charset();
-			else if (detect_noniso(text))
-				charset = get_encoding_items(get_encoding_code())->item[CODEPAGE];
-			else
-				charset = get_encoding_items(get_encoding_code())->item[OPENI18N];
-			if (!charset)
-				charset = get_encoding_items(get_encoding_code())->item[IANA];					
-		}
+		CharsetCandidate *cands;
+		gint num;
+		
+		cands = detect_charset_candidates(text, strlen(text), flags, &num);
+		if (num)
+			charset = cands[0].charset;
+		else
+			charset = get_default_charset();
+		g_free(cands);
 	}
 	
 	return charset;
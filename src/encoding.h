@@ -38,12 +38,41 @@ enum {
 	CR = 0x0D,
 };
 
+/* classify_text() flags */
+enum {
+	TEXT_ASCII   = 1 << 0,
+	TEXT_UTF8    = 1 << 1,
+	TEXT_HAS_ESC = 1 << 2,
+	TEXT_HAS_C1  = 1 << 3
+};
+
+typedef struct {
+	gsize lf;
+	gsize crlf;
+	gsize cr;
+	gboolean cr_pending;
+} LineEndStats;
+
+typedef struct {
+	const gchar *charset;
+	gdouble confidence;
+} CharsetCandidate;
+
 guint get_encoding_code(void);
 EncArray *get_encoding_items(guint code);
 const gchar *get_default_charset(void);
 gint detect_line_ending(const gchar *text);
 void convert_line_ending_to_lf(gchar *text);
+gsize convert_line_ending_to_lf_len(gchar *text, gsize len, LineEndStats *stats);
+void count_line_endings(const gchar *text, gsize len, LineEndStats *stats);
+void line_end_stats_finish(LineEndStats *stats);
+gboolean line_end_stats_mixed(const LineEndStats *stats);
+gint line_end_stats_major(const LineEndStats *stats, gint fallback);
+gsize convert_line_ending_from_lf(const gchar *text, gsize len, gchar *out, gint retcode);
 void convert_line_ending(gchar **text, gint retcode);
+guint classify_text(const gchar *text, gsize len);
+CharsetCandidate *detect_charset_candidates(const gchar *text, gsize len,
+	guint flags, gint *num);
 const gchar *detect_charset(const gchar *text);
 
 #endif  /* _ENCODING_H */
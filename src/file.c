@@ -18,15 +18,21 @@
  */
 
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "file.h"
 #include "view.h"
 #include "encoding.h"
 #include "dialog.h"
 #include "menu.h"
+#include "window.h"
 #include "i18n.h"
-//#include "undo.h"
+#include "undo.h"
 
 gboolean check_file_writable(gchar *filename)
 {
@@ -102,18 +108,562 @@ gchar *parse_file_uri(gchar *uri)
 	return filename;
 }
 
+/*
+ * Big files are mapped instead of being read into memory, and are
+ * converted and inserted into the buffer chunk by chunk, so that only
+ * the buffer itself grows with the size of the file.
+ */
+#define FILE_READ_CHUNK_SIZE	(256 * 1024)
+#define FILE_CONVERT_BUF_SIZE	(256 * 1024)
+#define FILE_CARRY_SIZE		16	/* longest incomplete multi-byte sequence */
+#define FILE_DETECT_SIZE	(64 * 1024)
+
+gboolean file_map_open(FileMap *map, const gchar *filename, GError **err)
+{
+#if GLIB_CHECK_VERSION(2, 8, 0)
+	map->mapped = g_mapped_file_new(filename, FALSE, err);
+	if (!map->mapped)
+		return FALSE;
+	map->contents = g_mapped_file_get_contents(map->mapped);
+	map->length = g_mapped_file_get_length(map->mapped);
+	return TRUE;
+#else
+	return g_file_get_contents(filename, &map->contents, &map->length, err);
+#endif
+}
+
+void file_map_close(FileMap *map)
+{
+#if GLIB_CHECK_VERSION(2, 22, 0)
+	if (map->mapped)
+		g_mapped_file_unref(map->mapped);
+#elif GLIB_CHECK_VERSION(2, 8, 0)
+	if (map->mapped)
+		g_mapped_file_free(map->mapped);
+#else
+	g_free(map->contents);
+#endif
+}
+
+/* bound a sample for the detectors, cut at a line end so that a multi-byte
+   character is never split; with no line end, before the UTF-8 character
+   the bound falls in */
+static gsize file_get_detect_length(const gchar *contents, gsize length)
+{
+	gsize len = length, i;
+	
+	if (len > FILE_DETECT_SIZE) {
+		len = FILE_DETECT_SIZE;
+		while (len > 0 && contents[len - 1] != LF)
+			len--;
+		if (len == 0) {
+			len = FILE_DETECT_SIZE;
+			for (i = 0; i < 3 && (contents[len] & 0xC0) == 0x80; i++)
+				len--;
+		}
+	}
+	
+	return len;
+}
+
+/* copy a bounded, NUL-terminated prefix for the detectors */
+gchar *file_get_detect_prefix(const gchar *contents, gsize length)
+{
+	return g_strndup(contents, file_get_detect_length(contents, length));
+}
+
+typedef void (*FileChunkFunc)(const gchar *text, gsize len, gpointer data);
+
+/*
+ * Decoding runs through one GIConv for the whole stream. At an invalid
+ * sequence the decoder picks one of the strategies below; whatever was
+ * converted before the error is kept in every case.
+ */
+enum {
+	FILE_DECODE_STOP,	/* give up; the caller may start over */
+	FILE_DECODE_FALLBACK,	/* go on in another charset */
+	FILE_DECODE_SUBSTITUTE	/* put U+FFFD in place of the bad byte */
+};
+
+typedef struct {
+	GIConv cd;
+	const gchar *charset;	/* the one in use, which may change midway */
+	const gchar *requested;
+	gsize ascii_end;	/* no byte before this offset is above 0x7F */
+	gsize error_offset;	/* of the first invalid sequence, if any */
+	gsize replaced;
+	gboolean can_stop;
+} FileDecoder;
+
+#define FILE_REPLACEMENT_CHAR	"\xEF\xBF\xBD"
+
+static gboolean file_decoder_open(FileDecoder *dec, const gchar *charset,
+	gboolean can_stop)
+{
+	dec->cd = g_iconv_open("UTF-8", charset);
+	if (dec->cd == (GIConv) -1)
+		return FALSE;
+	dec->charset = dec->requested = charset;
+	dec->ascii_end = 0;
+	dec->error_offset = G_MAXSIZE;
+	dec->replaced = 0;
+	dec->can_stop = can_stop;
+	
+	return TRUE;
+}
+
+static void file_decoder_close(FileDecoder *dec)
+{
+	g_iconv_close(dec->cd);
+}
+
+/* charsets in which ASCII bytes may stand for something else */
+static gboolean file_charset_is_ascii_safe(const gchar *charset)
+{
+	static const gchar *unsafe[] = {
+		"ISO-2022", "UTF-7", "UTF-16", "UTF-32", "UCS", NULL
+	};
+	gint i;
+	
+	for (i = 0; unsafe[i]; i++)
+		if (g_ascii_strncasecmp(charset, unsafe[i], strlen(unsafe[i])) == 0)
+			return FALSE;
+	
+	return TRUE;
+}
+
+/*
+ * Called at an invalid sequence at offset. If all the text before it was
+ * ASCII, it reads the same in any other charset, so decoding can go on in
+ * the charset detected from the rest without redoing anything. An error
+ * early in the file stops the decoder, as starting over costs little.
+ * Anywhere else, the bad byte is replaced.
+ */
+static gint file_decoder_error(FileDecoder *dec, const gchar *contents,
+	gsize length, gsize offset)
+{
+	const gchar *charset;
+	gchar *sample;
+	GIConv cd;
+	
+	if (dec->error_offset == G_MAXSIZE)
+		dec->error_offset = offset;
+	
+	while (dec->ascii_end < offset && !(contents[dec->ascii_end] & 0x80))
+		dec->ascii_end++;
+	if (dec->ascii_end == offset && !dec->replaced
+		&& file_charset_is_ascii_safe(dec->charset)) {
+		sample = file_get_detect_prefix(contents + offset, length - offset);
+		charset = detect_charset(sample);
+		g_free(sample);
+		if (!charset || g_ascii_strcasecmp(charset, dec->charset) == 0
+			|| !file_charset_is_ascii_safe(charset))
+			charset = "ISO-8859-1";
+		if (g_ascii_strcasecmp(charset, dec->charset) != 0
+			&& (cd = g_iconv_open("UTF-8", charset)) != (GIConv) -1) {
+			g_iconv_close(dec->cd);
+			dec->cd = cd;
+			dec->charset = charset;
+			return FILE_DECODE_FALLBACK;
+		}
+	}
+	if (dec->can_stop && offset < FILE_READ_CHUNK_SIZE)
+		return FILE_DECODE_STOP;
+	dec->replaced++;
+	g_iconv(dec->cd, NULL, NULL, NULL, NULL);
+	
+	return FILE_DECODE_SUBSTITUTE;
+}
+
+static void file_emit_chunk(gchar *text, gsize len, LineEndStats *stats,
+	FileChunkFunc func, gpointer data)
+{
+	len = convert_line_ending_to_lf_len(text, len, stats);
+	if (len)
+		func(text, len, data);
+}
+
+/* convert contents to UTF-8 with LF line endings, handing the result to
+   func in pieces of at most FILE_CONVERT_BUF_SIZE bytes; the original line
+   endings are counted in stats */
+static gboolean file_convert_chunks(const gchar *contents, gsize length,
+	FileDecoder *dec, LineEndStats *stats, FileChunkFunc func, gpointer data,
+	volatile gint *cancel, volatile gint *permille)
+{
+	gchar *inbuf, *outbuf, *in, *out;
+	gsize pos = 0, carry = 0, base, n, inleft, outleft, res;
+	gboolean retval = TRUE;
+	gint errsv;
+	
+	inbuf = g_malloc(FILE_READ_CHUNK_SIZE + FILE_CARRY_SIZE);
+	outbuf = g_malloc(FILE_CONVERT_BUF_SIZE);
+	
+	while (retval && pos < length) {
+		if (cancel && g_atomic_int_get(cancel))
+			break;
+		n = MIN(FILE_READ_CHUNK_SIZE, length - pos);
+		memcpy(inbuf + carry, contents + pos, n);
+		base = pos - carry;
+		pos += n;
+		in = inbuf;
+		inleft = carry + n;
+		
+		while (inleft) {
+			out = outbuf;
+			outleft = FILE_CONVERT_BUF_SIZE;
+			res = g_iconv(dec->cd, &in, &inleft, &out, &outleft);
+			errsv = errno;
+			if (res != (gsize) -1 || errsv == E2BIG) {
+				file_emit_chunk(outbuf, out - outbuf, stats, func, data);
+				continue;
+			}
+			/* an incomplete sequence is completed by the next chunk */
+			if (errsv == EINVAL && inleft <= FILE_CARRY_SIZE && pos < length) {
+				file_emit_chunk(outbuf, out - outbuf, stats, func, data);
+				break;
+			}
+			switch (file_decoder_error(dec, contents, length,
+				base + (in - inbuf))) {
+			case FILE_DECODE_STOP:
+				retval = FALSE;
+				break;
+			case FILE_DECODE_SUBSTITUTE:
+				if (outleft >= sizeof(FILE_REPLACEMENT_CHAR) - 1) {
+					memcpy(out, FILE_REPLACEMENT_CHAR,
+						sizeof(FILE_REPLACEMENT_CHAR) - 1);
+					out += sizeof(FILE_REPLACEMENT_CHAR) - 1;
+				} else {
+					file_emit_chunk(outbuf, out - outbuf, stats, func, data);
+					out = outbuf;
+					memcpy(out, FILE_REPLACEMENT_CHAR,
+						sizeof(FILE_REPLACEMENT_CHAR) - 1);
+					out += sizeof(FILE_REPLACEMENT_CHAR) - 1;
+				}
+				in++;
+				inleft--;
+				break;
+			}
+			file_emit_chunk(outbuf, out - outbuf, stats, func, data);
+			if (!retval)
+				break;
+		}
+		carry = inleft;
+		memmove(inbuf, in, carry);
+		if (permille)
+			g_atomic_int_set(permille, (gint) ((gdouble) pos / length * 1000));
+	}
+	
+	if (retval) {
+		out = outbuf;
+		outleft = FILE_CONVERT_BUF_SIZE;
+		g_iconv(dec->cd, NULL, NULL, &out, &outleft);
+		file_emit_chunk(outbuf, out - outbuf, stats, func, data);
+		line_end_stats_finish(stats);
+	}
+	
+	g_free(outbuf);
+	g_free(inbuf);
+	
+	return retval;
+}
+
+static void file_insert_chunk(const gchar *text, gsize len, gpointer data)
+{
+	gtk_text_buffer_insert(GTK_TEXT_BUFFER(data), NULL, text, len);
+}
+
+static gboolean file_insert_converted(GtkTextBuffer *buffer,
+	const gchar *contents, gsize length, FileDecoder *dec,
+	LineEndStats *stats)
+{
+	memset(stats, 0, sizeof(LineEndStats));
+	return file_convert_chunks(contents, length, dec, stats,
+		file_insert_chunk, buffer, NULL, NULL);
+}
+
+static void file_set_charset(FileInfo *fi, const gchar *charset)
+{
+	if (charset != fi->charset) {
+		g_free(fi->charset);
+		fi->charset = g_strdup(charset);
+		if (fi->charset_flag)
+			fi->charset_flag = FALSE;
+	}
+}
+
+/* tell what the decoder had to do to get through the file */
+static void file_report_decoding(GtkWidget *view, const FileDecoder *dec)
+{
+	if (dec->replaced)
+		run_dialog_message(gtk_widget_get_toplevel(view), GTK_MESSAGE_WARNING,
+			_("This file is not valid %s from byte %lu on.\n"
+			"%lu invalid bytes were replaced, and will not be saved back."),
+			dec->charset, (gulong) dec->error_offset, (gulong) dec->replaced);
+	else if (dec->charset != dec->requested)
+		run_dialog_message(gtk_widget_get_toplevel(view), GTK_MESSAGE_WARNING,
+			_("This file is not valid %s from byte %lu on.\n"
+			"It was read as %s instead."),
+			dec->requested, (gulong) dec->error_offset, dec->charset);
+}
+
+/* the file is saved with its most common line ending */
+static void file_check_line_endings(GtkWidget *view, FileInfo *fi,
+	const LineEndStats *stats)
+{
+	fi->lineend = line_end_stats_major(stats, fi->lineend);
+	if (line_end_stats_mixed(stats))
+		run_dialog_message(gtk_widget_get_toplevel(view), GTK_MESSAGE_WARNING,
+			_("This file has mixed line endings (LF: %lu, CR+LF: %lu, CR: %lu).\n"
+			"They will all be saved as %s."),
+			(gulong) stats->lf, (gulong) stats->crlf, (gulong) stats->cr,
+			fi->lineend == CR+LF ? "CR+LF" : fi->lineend == CR ? "CR" : "LF");
+}
+
+/*
+ * Files larger than FILE_ASYNC_THRESHOLD are converted by a worker thread.
+ * The converted pieces are passed back through a queue and inserted by an
+ * idle handler, a few at a time, so that the window keeps being redrawn
+ * and the part already loaded can be scrolled while the rest comes in.
+ */
+#define FILE_ASYNC_THRESHOLD	(4 * 1024 * 1024)
+#define FILE_QUEUE_MAX		16
+#define FILE_IDLE_BUDGET	0.02	/* seconds of inserting per idle call */
+
+typedef struct {
+	gchar *text;	/* NULL marks the end of the stream */
+	gsize len;
+	gboolean failed;
+} FileChunk;
+
+typedef struct {
+	GtkWidget *view;
+	FileInfo *fi;
+	FileMap map;
+	FileDecoder dec;
+	LineEndStats stats;
+	gboolean cursor_placed;
+	gboolean complete;
+	GThread *thread;
+	GAsyncQueue *queue;
+	guint idle_id;
+	volatile gint cancel;
+	volatile gint permille;
+} FileLoader;
+
+static FileLoader *loader = NULL;
+
+static void file_queue_chunk(const gchar *text, gsize len, gpointer data)
+{
+	FileLoader *ld = data;
+	FileChunk *chunk = g_new(FileChunk, 1);
+	
+	chunk->text = g_memdup(text, len);
+	chunk->len = len;
+	chunk->failed = FALSE;
+	/* don't let the thread run far ahead of the main loop */
+	while (g_async_queue_length(ld->queue) > FILE_QUEUE_MAX
+		&& !g_atomic_int_get(&ld->cancel))
+		g_usleep(1000);
+	g_async_queue_push(ld->queue, chunk);
+}
+
+static gpointer file_load_thread(gpointer data)
+{
+	FileLoader *ld = data;
+	FileChunk *chunk = g_new(FileChunk, 1);
+	
+	chunk->failed = !file_convert_chunks(ld->map.contents, ld->map.length,
+		&ld->dec, &ld->stats, file_queue_chunk, ld,
+		&ld->cancel, &ld->permille);
+	file_decoder_close(&ld->dec);
+	chunk->text = NULL;
+	chunk->len = 0;
+	g_async_queue_push(ld->queue, chunk);
+	
+	return NULL;
+}
+
+/* ISO-8859-1 decodes anything, so it is where a stopped decoder starts over */
+static gboolean file_load_start_thread(FileLoader *ld, const gchar *charset)
+{
+	ld->permille = 0;
+	memset(&ld->stats, 0, sizeof(LineEndStats));
+	if (!file_decoder_open(&ld->dec, charset, strcmp(charset, "ISO-8859-1") != 0)
+		&& !file_decoder_open(&ld->dec, "ISO-8859-1", FALSE))
+		return FALSE;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	ld->thread = g_thread_try_new("file-loader", file_load_thread, ld, NULL);
+#else
+	ld->thread = g_thread_create(file_load_thread, ld, TRUE, NULL);
+#endif
+	if (!ld->thread)
+		file_decoder_close(&ld->dec);
+	return ld->thread != NULL;
+}
+
+static void file_load_stop_thread(FileLoader *ld)
+{
+	FileChunk *chunk;
+	
+	if (ld->thread) {
+		g_atomic_int_set(&ld->cancel, TRUE);
+		g_thread_join(ld->thread);
+		ld->thread = NULL;
+		g_atomic_int_set(&ld->cancel, FALSE);
+	}
+	while ((chunk = g_async_queue_try_pop(ld->queue))) {
+		g_free(chunk->text);
+		g_free(chunk);
+	}
+}
+
+static void file_load_finish(FileLoader *ld)
+{
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(ld->view));
+	GtkWidget *view = ld->view;
+	FileInfo *fi = ld->fi;
+	LineEndStats stats = ld->stats;
+	FileDecoder dec = ld->dec;
+	gboolean complete = ld->complete;
+	
+	file_load_stop_thread(ld);
+	if (ld->idle_id)
+		g_source_remove(ld->idle_id);
+	g_async_queue_unref(ld->queue);
+	file_map_close(&ld->map);
+	
+	gtk_text_buffer_set_modified(buffer, FALSE);
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(ld->view), TRUE);
+	menu_sensitivity_from_editable(TRUE);
+	force_unblock_cb_modified_changed(ld->view);
+	hide_main_window_progress();
+	
+	g_free(ld);
+	loader = NULL;
+	
+	if (complete) {
+		file_report_decoding(view, &dec);
+		file_set_charset(fi, dec.charset);
+		file_check_line_endings(view, fi, &stats);
+		undo_journal_attach(buffer, fi->filename);
+	}
+}
+
+static gboolean file_load_idle(gpointer data)
+{
+	FileLoader *ld = data;
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(ld->view));
+	GtkTextIter iter;
+	GTimer *timer;
+	FileChunk *chunk;
+	gboolean done = FALSE;
+	
+	timer = g_timer_new();
+	gtk_text_buffer_get_end_iter(buffer, &iter);
+	while (!done && g_timer_elapsed(timer, NULL) < FILE_IDLE_BUDGET
+		&& (chunk = g_async_queue_try_pop(ld->queue))) {
+		if (chunk->text) {
+			gtk_text_buffer_insert(buffer, &iter, chunk->text, chunk->len);
+			g_free(chunk->text);
+			if (!ld->cursor_placed) {
+				GtkTextIter start;
+				
+				gtk_text_buffer_get_start_iter(buffer, &start);
+				gtk_text_buffer_place_cursor(buffer, &start);
+				ld->cursor_placed = TRUE;
+			}
+		} else if (chunk->failed && ld->dec.can_stop) {
+			/* same fallback as the synchronous path, started over */
+			g_thread_join(ld->thread);
+			ld->thread = NULL;
+			ld->cursor_placed = FALSE;
+			gtk_text_buffer_set_text(buffer, "", 0);
+			gtk_text_buffer_get_end_iter(buffer, &iter);
+			if (!file_load_start_thread(ld, "ISO-8859-1"))
+				done = TRUE;
+		} else {
+			ld->complete = !chunk->failed;
+			done = TRUE;
+		}
+		g_free(chunk);
+	}
+	g_timer_destroy(timer);
+	
+	/* keep the unfinished text from looking like a modification */
+	gtk_text_buffer_set_modified(buffer, FALSE);
+	
+	if (done) {
+		ld->idle_id = 0;
+		file_load_finish(ld);
+		return FALSE;
+	}
+	show_main_window_progress(g_atomic_int_get(&ld->permille) / 1000.0);
+	return TRUE;
+}
+
+gboolean file_open_in_progress(void)
+{
+	return loader != NULL;
+}
+
+/* stop loading; the part already loaded is left in the buffer */
+void file_open_cancel(void)
+{
+	if (loader)
+		file_load_finish(loader);
+}
+
+static gboolean file_open_async(GtkWidget *view, FileInfo *fi, FileMap *map,
+	const gchar *charset)
+{
+	FileLoader *ld;
+	
+	if (!g_thread_supported())
+		return FALSE;
+	
+	ld = g_new0(FileLoader, 1);
+	ld->view = view;
+	ld->fi = fi;
+	ld->map = *map;
+	ld->queue = g_async_queue_new();
+	if (!file_load_start_thread(ld, charset)) {
+		g_async_queue_unref(ld->queue);
+		g_free(ld);
+		return FALSE;
+	}
+	loader = ld;
+	
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+	menu_sensitivity_from_editable(FALSE);
+	force_block_cb_modified_changed(view);
+	set_main_window_progress_text(_("Loading..."));
+	show_main_window_progress(0);
+	ld->idle_id = g_idle_add(file_load_idle, ld);
+	
+	return TRUE;
+}
+
 gint file_open_real(GtkWidget *view, FileInfo *fi)
 {
-	gchar *contents;
-	gsize length;
+	FileMap map;
 	GError *err = NULL;
 	const gchar *charset;
-	gchar *str = NULL;
+	gchar *prefix, *nul;
 	GtkTextIter iter;
+	FileDecoder dec;
+	LineEndStats stats;
+	gboolean async = FALSE;
 	
 	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
 	
-	if (!g_file_get_contents(fi->filename, &contents, &length, &err)) {
+	/* a save still reads the buffer; drops get past its grab */
+	if (file_save_in_progress()) {
+		run_dialog_message(gtk_widget_get_toplevel(view),
+			GTK_MESSAGE_ERROR, _("Can't open a file while saving"));
+		return -1;
+	}
+	
+	if (!file_map_open(&map, fi->filename, &err)) {
 		if (g_file_test(fi->filename, G_FILE_TEST_EXISTS)) {
 			run_dialog_message(gtk_widget_get_toplevel(view),
 				GTK_MESSAGE_ERROR, err->message);
@@ -122,116 +672,576 @@ gint file_open_real(GtkWidget *view, FileInfo *fi)
 		}
 		g_error_free(err);
 		err = NULL;
-		contents = g_strdup("");
+#if GLIB_CHECK_VERSION(2, 8, 0)
+		map.mapped = NULL;
+#endif
+		map.contents = NULL;
+		map.length = 0;
 	}
 	
-	fi->lineend = detect_line_ending(contents);
-	if (fi->lineend != LF)
-		convert_line_ending_to_lf(contents);
+	/* a file that failed to open leaves the one loading untouched */
+	file_open_cancel();
+	
+	/* as before, text following a NUL byte is not loaded */
+	if (map.length && (nul = memchr(map.contents, '\0', map.length)))
+		map.length = nul - map.contents;
+	
+	prefix = file_get_detect_prefix(map.contents, map.length);
+	fi->lineend = detect_line_ending(prefix);
 	
 	if (fi->charset)
 		charset = fi->charset;
 	else {
-		charset = detect_charset(contents);
+		charset = detect_charset(prefix);
 		if (charset == NULL)
 			charset = get_default_charset();
 	}
-
-	if (length)
-		do {
-			if (err) {
-				charset = "ISO-8859-1";
-				g_error_free(err);
-				err = NULL;
-			}
-			str = g_convert(contents, -1, "UTF-8", charset, NULL, NULL, &err);
-		} while (err);
-	else
-		str = g_strdup("");
-	g_free(contents);
-	
-	if (charset != fi->charset) {
-		g_free(fi->charset);
-		fi->charset = g_strdup(charset);
-		if (fi->charset_flag)
-			fi->charset_flag = FALSE;
-	}
+	g_free(prefix);
 	
 //	undo_disconnect_signal(textbuffer);
 //	undo_block_signal(buffer);
 	force_block_cb_modified_changed(view);
 	
 	gtk_text_buffer_set_text(buffer, "", 0);
-	gtk_text_buffer_get_start_iter(buffer, &iter);
-	gtk_text_buffer_insert(buffer, &iter, str, strlen(str));
+	undo_clear_all(buffer);
+	if (map.length > FILE_ASYNC_THRESHOLD)
+		async = file_open_async(view, fi, &map, charset);
+	if (!async && map.length) {
+		/* ISO-8859-1 decodes anything, so it is where a stopped decoder
+		   starts over */
+		if (!file_decoder_open(&dec, charset, strcmp(charset, "ISO-8859-1") != 0))
+			file_decoder_open(&dec, "ISO-8859-1", FALSE);
+		if (!file_insert_converted(buffer, map.contents, map.length,
+			&dec, &stats)) {
+			file_decoder_close(&dec);
+			file_decoder_open(&dec, "ISO-8859-1", FALSE);
+			gtk_text_buffer_set_text(buffer, "", 0);
+			file_insert_converted(buffer, map.contents, map.length,
+				&dec, &stats);
+		}
+		file_decoder_close(&dec);
+		file_report_decoding(view, &dec);
+		charset = dec.charset;
+	}
+	if (!async)
+		file_map_close(&map);
+	
+	file_set_charset(fi, charset);
+	
 	gtk_text_buffer_get_start_iter(buffer, &iter);
 	gtk_text_buffer_place_cursor(buffer, &iter);
 	gtk_text_buffer_set_modified(buffer, FALSE);
 	gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(view), &iter, 0, FALSE, 0, 0);
-	g_free(str);
 	
 	force_unblock_cb_modified_changed(view);
 	menu_sensitivity_from_modified_flag(FALSE);
 //	undo_unblock_signal(buffer);
 	
+	if (!async && map.length)
+		file_check_line_endings(view, fi, &stats);
+	if (!async)
+		undo_journal_attach(buffer, fi->filename);
+	
 	return 0;
 }
 
-gint file_save_real(GtkWidget *view, FileInfo *fi)
+/*
+ * Saving walks the buffer in segments and converts each one through a
+ * fixed-size output buffer, so memory use doesn't depend on the size of
+ * the document.
+ */
+#define FILE_SEGMENT_CHARS	(64 * 1024)
+#define FILE_WRITE_BUF_SIZE	(64 * 1024)
+
+enum {
+	FILE_WRITE_OK = 0,
+	FILE_WRITE_CONVERT_ERROR,
+	FILE_WRITE_OPEN_ERROR,
+	FILE_WRITE_IO_ERROR,
+	FILE_WRITE_CANCELLED
+};
+
+typedef struct {
+	FILE *fp;	/* NULL to only check that the text converts */
+	GIConv cd;
+	gint lineend;
+	GString *scratch;
+	gchar *outbuf;
+	gsize outlen;
+	gint status;
+} FileWriter;
+
+static void file_writer_flush(FileWriter *fw)
+{
+	if (fw->fp && fw->outlen
+		&& fwrite(fw->outbuf, 1, fw->outlen, fw->fp) != fw->outlen)
+		fw->status = FILE_WRITE_IO_ERROR;
+	fw->outlen = 0;
+}
+
+/* pass in == NULL at the end to reset the shift state and flush */
+static void file_writer_convert(FileWriter *fw, gchar *in, gsize inleft)
+{
+	gchar *out;
+	gsize outleft, res;
+	
+	while (fw->status == FILE_WRITE_OK) {
+		out = fw->outbuf + fw->outlen;
+		outleft = FILE_WRITE_BUF_SIZE - fw->outlen;
+		res = g_iconv(fw->cd, in ? &in : NULL, in ? &inleft : NULL,
+			&out, &outleft);
+		fw->outlen = FILE_WRITE_BUF_SIZE - outleft;
+		if (res != (gsize) -1) {
+			if (!in)
+				file_writer_flush(fw);
+			break;
+		}
+		if (errno != E2BIG)
+			fw->status = FILE_WRITE_CONVERT_ERROR;
+		else
+			file_writer_flush(fw);
+	}
+}
+
+static void file_writer_write(FileWriter *fw, const gchar *text, gsize len)
 {
+	if (fw->lineend == LF) {
+		file_writer_convert(fw, (gchar *) text, len);
+		return;
+	}
+	g_string_set_size(fw->scratch, len * 2);
+	len = convert_line_ending_from_lf(text, len, fw->scratch->str,
+		fw->lineend);
+	file_writer_convert(fw, fw->scratch->str, len);
+}
+
+static gboolean file_writer_init(FileWriter *fw, FILE *fp,
+	const gchar *charset, gint lineend)
+{
+	fw->cd = g_iconv_open(charset, "UTF-8");
+	if (fw->cd == (GIConv) -1)
+		return FALSE;
+	fw->fp = fp;
+	fw->lineend = lineend;
+	fw->scratch = g_string_sized_new(FILE_WRITE_BUF_SIZE);
+	fw->outbuf = g_malloc(FILE_WRITE_BUF_SIZE);
+	fw->outlen = 0;
+	fw->status = FILE_WRITE_OK;
+	
+	return TRUE;
+}
+
+static gint file_writer_finish(FileWriter *fw)
+{
+	file_writer_convert(fw, NULL, 0);
+	
+	g_free(fw->outbuf);
+	g_string_free(fw->scratch, TRUE);
+	g_iconv_close(fw->cd);
+	
+	return fw->status;
+}
+
+static gint file_write_buffer(GtkTextBuffer *buffer, FILE *fp,
+	const gchar *charset, gint lineend)
+{
+	FileWriter fw;
+	GtkTextIter start, end;
+	gchar *str;
+	
+	if (!file_writer_init(&fw, fp, charset, lineend))
+		return FILE_WRITE_CONVERT_ERROR;
+	
+	gtk_text_buffer_get_start_iter(buffer, &start);
+	while (fw.status == FILE_WRITE_OK && !gtk_text_iter_is_end(&start)) {
+		end = start;
+		gtk_text_iter_forward_chars(&end, FILE_SEGMENT_CHARS);
+		str = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+		file_writer_write(&fw, str, strlen(str));
+		g_free(str);
+		start = end;
+	}
+	
+	return file_writer_finish(&fw);
+}
+
+/*
+ * Saving normally goes to a temporary file next to the target which is
+ * synced and renamed over it, so a failure at any point leaves the old
+ * file untouched. The text is taken out of the buffer on the main thread;
+ * for big buffers the conversion, writing and syncing run on a writer
+ * thread while the window stays responsive.
+ */
+
+#define FILE_SAVE_ASYNC_CHARS	(4 * 1024 * 1024)
+
+typedef struct {
+	FileWriter fw;
+	const gchar *tmpname;
+	const gchar *target;
+	GThread *thread;
+	GAsyncQueue *queue;
+	volatile gint done;
+	volatile gint cancel;
+} FileSaver;
+
+static FileSaver *saver = NULL;
+
+/* follow a symlink so that the link itself is kept */
+static gchar *file_resolve_target(const gchar *filename)
+{
+	gchar *path, *target;
+	
+	if (g_file_test(filename, G_FILE_TEST_IS_SYMLINK)) {
+		path = realpath(filename, NULL);
+		if (path) {
+			target = g_strdup(path);
+			free(path);
+			return target;
+		}
+	}
+	
+	return g_strdup(filename);
+}
+
+static gint file_create_temp(const gchar *target, gchar **tmpname)
+{
+	gchar *dirname, *basename, *tmpl;
+	gint fd;
+	
+	dirname = g_path_get_dirname(target);
+	basename = g_path_get_basename(target);
+	tmpl = g_strdup_printf(".%s.XXXXXX", basename);
+	*tmpname = g_build_filename(dirname, tmpl, NULL);
+	g_free(tmpl);
+	g_free(basename);
+	g_free(dirname);
+	
+	fd = g_mkstemp(*tmpname);
+	if (fd < 0) {
+		g_free(*tmpname);
+		*tmpname = NULL;
+	}
+	
+	return fd;
+}
+
+static void file_copy_attributes(gint fd, const gchar *target)
+{
+	struct stat st;
+	mode_t mask;
+	
+	if (g_stat(target, &st) == 0) {
+		/* only root may give the file away; try to keep the group at least */
+		if (fchown(fd, st.st_uid, st.st_gid) != 0)
+			fchown(fd, -1, st.st_gid);
+		/* after chown, which may clear the set-id bits */
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+}
+
+/* a hard linked or read-only file has to be rewritten where it is */
+static gboolean file_can_replace(const gchar *target)
+{
+	struct stat st;
+	
+	if (g_stat(target, &st) != 0)
+		return TRUE;
+	
+	return S_ISREG(st.st_mode) && st.st_nlink == 1
+		&& g_access(target, W_OK) == 0;
+}
+
+/*
+ * Replaces a file on disk with data the way a save does, without the
+ * buffer. It may run in a thread. A file that can only be rewritten in
+ * place is left alone.
+ */
+gboolean file_replace_contents(const gchar *filename, const gchar *data,
+	gsize len, GError **err)
+{
+	gchar *target, *tmpname;
+	gint fd, errsv = 0;
+	gssize n = 0;
+	
+	target = file_resolve_target(filename);
+	if (!file_can_replace(target)) {
+		g_free(target);
+		g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_PERM, "%s",
+			_("Not replaced, as it is hard linked or read-only"));
+		return FALSE;
+	}
+	fd = file_create_temp(target, &tmpname);
+	if (fd < 0) {
+		errsv = errno;
+		g_free(target);
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+			"%s", g_strerror(errsv));
+		return FALSE;
+	}
+	file_copy_attributes(fd, target);
+	while (len && (n = write(fd, data, len)) > 0) {
+		data += n;
+		len -= n;
+	}
+	if (n < 0 || fsync(fd) != 0)
+		errsv = errno;
+	if (close(fd) != 0 && !errsv)
+		errsv = errno;
+	if (!errsv && g_rename(tmpname, target) != 0)
+		errsv = errno;
+	if (errsv) {
+		g_unlink(tmpname);
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+			"%s", g_strerror(errsv));
+	}
+	g_free(tmpname);
+	g_free(target);
+	
+	return !errsv;
+}
+
+static void file_save_commit(FileSaver *sv)
+{
+	FILE *fp = sv->fw.fp;
+	
+	file_writer_finish(&sv->fw);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		if (sv->fw.status == FILE_WRITE_OK)
+			sv->fw.status = FILE_WRITE_IO_ERROR;
+	if (fclose(fp) != 0 && sv->fw.status == FILE_WRITE_OK)
+		sv->fw.status = FILE_WRITE_IO_ERROR;
+	if (sv->fw.status == FILE_WRITE_OK && g_atomic_int_get(&sv->cancel))
+		sv->fw.status = FILE_WRITE_CANCELLED;
+	if (sv->fw.status == FILE_WRITE_OK
+		&& g_rename(sv->tmpname, sv->target) != 0)
+		sv->fw.status = FILE_WRITE_IO_ERROR;
+	if (sv->fw.status != FILE_WRITE_OK)
+		g_unlink(sv->tmpname);
+}
+
+static gpointer file_save_thread(gpointer data)
+{
+	FileSaver *sv = data;
+	FileChunk *chunk;
+	
+	while ((chunk = g_async_queue_pop(sv->queue))->text) {
+		if (sv->fw.status == FILE_WRITE_OK) {
+			file_writer_write(&sv->fw, chunk->text, chunk->len);
+			/* no use handing over the rest */
+			if (sv->fw.status != FILE_WRITE_OK)
+				g_atomic_int_set(&sv->cancel, TRUE);
+		}
+		g_free(chunk->text);
+		g_free(chunk);
+	}
+	g_free(chunk);
+	file_save_commit(sv);
+	g_atomic_int_set(&sv->done, TRUE);
+	
+	return NULL;
+}
+
+static gboolean file_save_start_thread(FileSaver *sv)
+{
+	sv->queue = g_async_queue_new();
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	sv->thread = g_thread_try_new("file-saver", file_save_thread, sv, NULL);
+#else
+	sv->thread = g_thread_create(file_save_thread, sv, TRUE, NULL);
+#endif
+	if (!sv->thread) {
+		g_async_queue_unref(sv->queue);
+		sv->queue = NULL;
+	}
+	
+	return sv->thread != NULL;
+}
+
+/* keep the window painted while waiting on the writer thread */
+static void file_save_wait(void)
+{
+	if (gtk_events_pending())
+		gtk_main_iteration();
+	else
+		g_usleep(1000);
+}
+
+static void file_save_push(FileSaver *sv, gchar *text, gsize len)
+{
+	FileChunk *chunk = g_new(FileChunk, 1);
+	
+	chunk->text = text;
+	chunk->len = len;
+	chunk->failed = FALSE;
+	g_async_queue_push(sv->queue, chunk);
+	while (text && g_async_queue_length(sv->queue) > FILE_QUEUE_MAX
+		&& !g_atomic_int_get(&sv->cancel))
+		file_save_wait();
+}
+
+gboolean file_save_in_progress(void)
+{
+	return saver != NULL;
+}
+
+/* the original file is left as it was */
+void file_save_cancel(void)
+{
+	if (saver)
+		g_atomic_int_set(&saver->cancel, TRUE);
+}
+
+static gint file_save_atomic(GtkWidget *view, FileInfo *fi, gint fd,
+	const gchar *tmpname, const gchar *target)
+{
+	FileSaver sv;
 	FILE *fp;
 	GtkTextIter start, end;
-	gchar *str, *cstr;
-	gsize rbytes, wbytes;
-	GError *err = NULL;
+	gchar *str;
+	gint total, done = 0;
 	
 	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
 	
-	gtk_text_buffer_get_start_iter(buffer, &start);
-	gtk_text_buffer_get_end_iter(buffer, &end);	
-	str = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
-	gtk_text_buffer_set_modified(buffer, FALSE);
+	file_copy_attributes(fd, target);
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		g_unlink(tmpname);
+		return FILE_WRITE_IO_ERROR;
+	}
+	if (!file_writer_init(&sv.fw, fp, fi->charset, fi->lineend)) {
+		fclose(fp);
+		g_unlink(tmpname);
+		return FILE_WRITE_CONVERT_ERROR;
+	}
+	sv.tmpname = tmpname;
+	sv.target = target;
+	sv.thread = NULL;
+	sv.queue = NULL;
+	sv.done = FALSE;
+	sv.cancel = FALSE;
 	
-	switch (fi->lineend) {
-	case CR:
-		convert_line_ending(&str, CR);
-		break;
-	case CR+LF:
-		convert_line_ending(&str, CR+LF);
+	total = gtk_text_buffer_get_char_count(buffer);
+	if (total > FILE_SAVE_ASYNC_CHARS && file_save_start_thread(&sv)) {
+		saver = &sv;
+		gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+		set_main_window_busy(TRUE);
+		set_main_window_progress_text(_("Saving..."));
+		show_main_window_progress(0);
 	}
 	
-	if (!fi->charset)
-		fi->charset = g_strdup(get_default_charset());
-	cstr = g_convert(str, -1, fi->charset, "UTF-8", &rbytes, &wbytes, &err);
-	g_free(str);
-	if (err) {
-		switch (err->code) {
-		case G_CONVERT_ERROR_ILLEGAL_SEQUENCE:
-			run_dialog_message(gtk_widget_get_toplevel(view),
-				GTK_MESSAGE_ERROR, _("Can't convert codeset to '%s'"), fi->charset);
-			break;
-		default:
-			run_dialog_message(gtk_widget_get_toplevel(view),
-				GTK_MESSAGE_ERROR, err->message);
+	gtk_text_buffer_get_start_iter(buffer, &start);
+	while (!gtk_text_iter_is_end(&start) && !g_atomic_int_get(&sv.cancel)) {
+		end = start;
+		gtk_text_iter_forward_chars(&end, FILE_SEGMENT_CHARS);
+		str = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+		start = end;
+		if (!sv.thread) {
+			file_writer_write(&sv.fw, str, strlen(str));
+			g_free(str);
+			if (sv.fw.status != FILE_WRITE_OK)
+				break;
+			continue;
 		}
-		g_error_free(err);
+		file_save_push(&sv, str, strlen(str));
+		done += FILE_SEGMENT_CHARS;
+		show_main_window_progress((gdouble) done / total);
+	}
+	
+	if (sv.thread) {
+		file_save_push(&sv, NULL, 0);
+		while (!g_atomic_int_get(&sv.done))
+			file_save_wait();
+		g_thread_join(sv.thread);
+		g_async_queue_unref(sv.queue);
+		saver = NULL;
+		hide_main_window_progress();
+		set_main_window_busy(FALSE);
+		gtk_text_view_set_editable(GTK_TEXT_VIEW(view), TRUE);
+	} else
+		file_save_commit(&sv);
+	
+	return sv.fw.status;
+}
+
+static gint file_save_in_place(GtkWidget *view, FileInfo *fi,
+	const gchar *target)
+{
+	FILE *fp;
+	gint status;
+	
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
+	
+	/* the file is truncated on open, so make sure the text converts first;
+	   nothing can fail converting to UTF-8 */
+	if (g_ascii_strcasecmp(fi->charset, "UTF-8") != 0
+		&& file_write_buffer(buffer, NULL, fi->charset, fi->lineend))
+		return FILE_WRITE_CONVERT_ERROR;
+	
+	fp = fopen(target, "w");
+	if (!fp)
+		return FILE_WRITE_OPEN_ERROR;
+	status = file_write_buffer(buffer, fp, fi->charset, fi->lineend);
+	if (fclose(fp) != 0 && status == FILE_WRITE_OK)
+		status = FILE_WRITE_IO_ERROR;
+	
+	return status;
+}
+
+gint file_save_real(GtkWidget *view, FileInfo *fi)
+{
+	gchar *target, *tmpname = NULL;
+	gint fd = -1, status;
+	
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
+	
+	if (file_open_in_progress()) {
+		run_dialog_message(gtk_widget_get_toplevel(view),
+			GTK_MESSAGE_ERROR, _("Can't save while the file is still loading"));
 		return -1;
 	}
+	if (file_save_in_progress())
+		return -1;
 	
-	fp = fopen(fi->filename, "w");
-	if (!fp) {
+	if (!fi->charset)
+		fi->charset = g_strdup(get_default_charset());
+	
+	target = file_resolve_target(fi->filename);
+	if (file_can_replace(target))
+		fd = file_create_temp(target, &tmpname);
+	if (fd >= 0)
+		status = file_save_atomic(view, fi, fd, tmpname, target);
+	else
+		status = file_save_in_place(view, fi, target);
+	g_free(tmpname);
+	g_free(target);
+	
+	switch (status) {
+	case FILE_WRITE_OK:
+		break;
+	case FILE_WRITE_CANCELLED:
+		return -1;
+	case FILE_WRITE_CONVERT_ERROR:
+		run_dialog_message(gtk_widget_get_toplevel(view),
+			GTK_MESSAGE_ERROR, _("Can't convert codeset to '%s'"), fi->charset);
+		return -1;
+	case FILE_WRITE_OPEN_ERROR:
 		run_dialog_message(gtk_widget_get_toplevel(view),
 			GTK_MESSAGE_ERROR, _("Can't open file to write"));
 		return -1;
-	}
-	if (fwrite(cstr, 1, wbytes, fp) != wbytes) {
+	default:
 		run_dialog_message(gtk_widget_get_toplevel(view),
 			GTK_MESSAGE_ERROR, _("Can't write file"));
 		return -1;
 	}
 	
-	fclose(fp);
-	g_free(cstr);
+	gtk_text_buffer_set_modified(buffer, FALSE);
+	undo_journal_attach(buffer, fi->filename);
 	
 	return 0;
 }
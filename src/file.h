@@ -27,10 +27,27 @@ typedef struct {
 	gchar lineend;
 } FileInfo;
 
+typedef struct {
+#if GLIB_CHECK_VERSION(2, 8, 0)
+	GMappedFile *mapped;
+#endif
+	gchar *contents;
+	gsize length;
+} FileMap;
+
 gboolean check_file_writable(gchar *filename);
 gchar *get_file_basename(gchar *filename, gboolean bracket);
 gchar *parse_file_uri(gchar *uri);
 gint file_open_real(GtkWidget *view, FileInfo *fi);
+gboolean file_open_in_progress(void);
+void file_open_cancel(void);
+gboolean file_save_in_progress(void);
+void file_save_cancel(void);
 gint file_save_real(GtkWidget *view, FileInfo *fi);
+gboolean file_replace_contents(const gchar *filename, const gchar *data,
+	gsize len, GError **err);
+gboolean file_map_open(FileMap *map, const gchar *filename, GError **err);
+void file_map_close(FileMap *map);
+gchar *file_get_detect_prefix(const gchar *contents, gsize length);
 
 #endif /* _FILE_H */
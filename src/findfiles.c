@@ -0,0 +1,726 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Find in Files walks a folder in one thread and hands each file to a pool
+ * of workers, one per core. Files are mapped, decoded with the detected
+ * charset when they are not UTF-8, and searched with the same TextSearch
+ * as the buffer. Matching lines are queued back and added to the results
+ * list by a timeout in the main loop while the search goes on.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include "leafpad.h"
+#include "findfiles.h"
+
+#define FIND_FILES_PROBE_SIZE	(64 * 1024)	/* looked at for a NUL byte */
+#define FIND_FILES_LINE_MAX	256	/* bytes of a line shown */
+#define FIND_FILES_POLL		50	/* ms between updates of the list */
+#define FIND_FILES_BUDGET	0.02	/* seconds of adding rows per update */
+
+enum {
+	COLUMN_FILE,
+	COLUMN_LINE,
+	COLUMN_TEXT,
+	COLUMN_PATH,
+	COLUMN_LINE_NUM,
+	COLUMN_OFFSET,
+	NUM_COLUMNS
+};
+
+typedef struct {
+	gchar *path;	/* NULL marks the end of the search */
+	gint line;	/* 0 for a note about the whole file */
+	gint offset;	/* chars into the line */
+	gchar *text;
+} FindHit;
+
+typedef struct {
+	TextSearch *ts;
+	gchar *folder;
+	GPatternSpec **patterns;
+	gchar *replacement;	/* NULL to only search */
+	gboolean skip;	/* the file open in the editor is not rewritten */
+	dev_t skip_dev;
+	ino_t skip_ino;
+	GThread *walker;
+	GThreadPool *pool;
+	GAsyncQueue *queue;
+	guint poll_id;
+	volatile gint cancel;
+	volatile gint matches;
+	volatile gint files;
+} FindFiles;
+
+static FindFiles *find_files = NULL;
+static GtkWidget *results_window = NULL;
+static GtkListStore *results_store = NULL;
+static GtkWidget *results_label = NULL;
+static gint jump_line, jump_offset;
+static guint jump_id = 0;
+
+static gchar *string_find = NULL;
+static gchar *string_replace = NULL;
+static gchar *string_folder = NULL;
+static gchar *string_names = NULL;
+static gboolean match_case = FALSE, use_regex = FALSE;
+
+static gint find_files_threads(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+	return g_get_num_processors();
+#elif defined(_SC_NPROCESSORS_ONLN)
+	return MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#else
+	return 2;
+#endif
+}
+
+static void find_files_push(FindFiles *ff, const gchar *path, gint line,
+	gint offset, gchar *text)
+{
+	FindHit *hit = g_new(FindHit, 1);
+	
+	hit->path = g_strdup(path);
+	hit->line = line;
+	hit->offset = offset;
+	hit->text = text;
+	g_async_queue_push(ff->queue, hit);
+}
+
+/* the line around a match, cut short without splitting a char */
+static gchar *find_files_get_line(const gchar *text, gsize len,
+	gsize line_start, gsize pos)
+{
+	const gchar *end;
+	gsize n;
+	
+	end = memchr(text + pos, '\n', len - pos);
+	n = (end ? end - text : len) - line_start;
+	if (n > FIND_FILES_LINE_MAX) {
+		n = FIND_FILES_LINE_MAX;
+		while (n > 0 && (text[line_start + n] & 0xC0) == 0x80)
+			n--;
+	}
+	if (n > 0 && text[line_start + n - 1] == '\r')
+		n--;
+	
+	return g_strndup(text + line_start, n);
+}
+
+/* in a worker; path is freed here */
+static void find_files_search(gchar *path, FindFiles *ff)
+{
+	FileMap map;
+	GString *out = NULL;
+	GError *err = NULL;
+	struct stat st;
+	const gchar *charset = "UTF-8", *text, *p;
+	gchar *prefix, *conv = NULL, *data;
+	gsize len, pos = 0, copied = 0, counted = 0, line_start = 0;
+	gsize start, end, n;
+	gint line = 1, last_line = 0, count = 0;
+	gboolean mapped;
+	
+	if (g_atomic_int_get(&ff->cancel) || !file_map_open(&map, path, NULL)) {
+		g_free(path);
+		return;
+	}
+	mapped = TRUE;
+	
+	/* like grep, a file with a NUL byte near the start is taken as binary */
+	if (!map.length
+		|| memchr(map.contents, '\0', MIN(map.length, FIND_FILES_PROBE_SIZE)))
+		goto done;
+	text = map.contents;
+	len = map.length;
+	prefix = file_get_detect_prefix(map.contents, map.length);
+	if (strchr(prefix, 0x1B) || !g_utf8_validate(map.contents, map.length, NULL)) {
+		charset = detect_charset(prefix);
+		conv = g_convert(map.contents, map.length, "UTF-8", charset,
+			NULL, &len, NULL);
+		text = conv;
+	}
+	g_free(prefix);
+	if (!text)
+		goto done;
+	
+	while (!g_atomic_int_get(&ff->cancel)
+		&& text_search_find_text(ff->ts, text, len, pos, &start, &end)) {
+		while ((p = memchr(text + counted, '\n', start - counted))) {
+			counted = p - text + 1;
+			line_start = counted;
+			line++;
+		}
+		counted = start;
+		if (line != last_line) {
+			find_files_push(ff, path, line,
+				g_utf8_strlen(text + line_start, start - line_start),
+				find_files_get_line(text, len, line_start, start));
+			last_line = line;
+		}
+		if (ff->replacement) {
+			if (!out)
+				out = g_string_sized_new(len + len / 16);
+			g_string_append_len(out, text + copied, start - copied);
+			data = text_search_expand_text(ff->ts, text, len, start,
+				ff->replacement);
+			g_string_append(out, data);
+			g_free(data);
+			copied = end;
+		}
+		pos = end;
+		count++;
+	}
+	if (!count || g_atomic_int_get(&ff->cancel))
+		goto done;
+	if (!out) {
+		g_atomic_int_add(&ff->matches, count);
+		g_atomic_int_add(&ff->files, 1);
+		goto done;
+	}
+	
+	if (ff->skip && g_stat(path, &st) == 0
+		&& st.st_dev == ff->skip_dev && st.st_ino == ff->skip_ino) {
+		find_files_push(ff, path, 0, 0,
+			g_strdup(_("Not replaced, as it is open in the editor")));
+		goto done;
+	}
+	g_string_append_len(out, text + copied, len - copied);
+	data = out->str;
+	n = out->len;
+	if (conv) {
+		g_free(conv);
+		conv = data = g_convert(out->str, out->len, charset, "UTF-8",
+			NULL, &n, &err);
+	}
+	/* the mapping goes before the file it maps is replaced */
+	file_map_close(&map);
+	mapped = FALSE;
+	if (!data || !file_replace_contents(path, data, n, &err)) {
+		find_files_push(ff, path, 0, 0, g_strdup(err->message));
+		g_error_free(err);
+	} else {
+		g_atomic_int_add(&ff->matches, count);
+		g_atomic_int_add(&ff->files, 1);
+	}
+	
+done:
+	if (mapped)
+		file_map_close(&map);
+	if (out)
+		g_string_free(out, TRUE);
+	g_free(conv);
+	g_free(path);
+}
+
+static gboolean find_files_match_name(FindFiles *ff, const gchar *name)
+{
+	gint i;
+	
+	if (!ff->patterns[0])
+		return TRUE;
+	for (i = 0; ff->patterns[i]; i++)
+		if (g_pattern_match_string(ff->patterns[i], name))
+			return TRUE;
+	
+	return FALSE;
+}
+
+/* hidden files and folders are left out, and so are links to folders */
+static void find_files_walk(FindFiles *ff, const gchar *folder)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *path;
+	
+	if (!(dir = g_dir_open(folder, 0, NULL)))
+		return;
+	while (!g_atomic_int_get(&ff->cancel) && (name = g_dir_read_name(dir))) {
+		if (name[0] == '.')
+			continue;
+		path = g_build_filename(folder, name, NULL);
+		if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+			if (!g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+				find_files_walk(ff, path);
+			g_free(path);
+		} else if (g_file_test(path, G_FILE_TEST_IS_REGULAR)
+			&& find_files_match_name(ff, name))
+			g_thread_pool_push(ff->pool, path, NULL);
+		else
+			g_free(path);
+	}
+	g_dir_close(dir);
+}
+
+static gpointer find_files_walk_thread(gpointer data)
+{
+	FindFiles *ff = data;
+	
+	find_files_walk(ff, ff->folder);
+	/* waits for the workers to be through with what was pushed */
+	g_thread_pool_free(ff->pool, FALSE, TRUE);
+	ff->pool = NULL;
+	g_async_queue_push(ff->queue, g_new0(FindHit, 1));
+	
+	return NULL;
+}
+
+static void find_hit_free(FindHit *hit)
+{
+	g_free(hit->path);
+	g_free(hit->text);
+	g_free(hit);
+}
+
+static void find_files_free(FindFiles *ff)
+{
+	FindHit *hit;
+	gint i;
+	
+	if (ff->walker)
+		g_thread_join(ff->walker);
+	if (ff->poll_id)
+		g_source_remove(ff->poll_id);
+	while ((hit = g_async_queue_try_pop(ff->queue)))
+		find_hit_free(hit);
+	g_async_queue_unref(ff->queue);
+	for (i = 0; ff->patterns[i]; i++)
+		g_pattern_spec_free(ff->patterns[i]);
+	g_free(ff->patterns);
+	text_search_unref(ff->ts);
+	g_free(ff->folder);
+	g_free(ff->replacement);
+	g_free(ff);
+}
+
+static void find_files_set_status(FindFiles *ff, gboolean running)
+{
+	gchar *str;
+	
+	if (ff->replacement)
+		str = g_strdup_printf(running ? _("Replacing... %d matches in %d files")
+			: _("%d matches replaced in %d files"),
+			g_atomic_int_get(&ff->matches), g_atomic_int_get(&ff->files));
+	else
+		str = g_strdup_printf(running ? _("Searching... %d matches in %d files")
+			: _("%d matches in %d files"),
+			g_atomic_int_get(&ff->matches), g_atomic_int_get(&ff->files));
+	gtk_label_set_text(GTK_LABEL(results_label), str);
+	g_free(str);
+}
+
+/* stops the search, keeping what has been found so far */
+static void find_files_stop(void)
+{
+	if (find_files) {
+		g_atomic_int_set(&find_files->cancel, TRUE);
+		if (results_window)
+			find_files_set_status(find_files, FALSE);
+		find_files_free(find_files);
+		find_files = NULL;
+	}
+}
+
+static gboolean find_files_poll(FindFiles *ff)
+{
+	GtkTreeIter iter;
+	GTimer *timer;
+	FindHit *hit;
+	gchar *file, *line;
+	gsize n = strlen(ff->folder);
+	gboolean done = FALSE;
+	
+	/* names are shown relative to the folder searched */
+	if (!G_IS_DIR_SEPARATOR(ff->folder[n - 1]))
+		n++;
+	
+	timer = g_timer_new();
+	while (!done && g_timer_elapsed(timer, NULL) < FIND_FILES_BUDGET
+		&& (hit = g_async_queue_try_pop(ff->queue))) {
+		if (hit->path) {
+			file = g_filename_to_utf8(hit->path + n, -1, NULL, NULL, NULL);
+			line = hit->line ? g_strdup_printf("%d", hit->line) : g_strdup("");
+			gtk_list_store_append(results_store, &iter);
+			gtk_list_store_set(results_store, &iter,
+				COLUMN_FILE, file ? file : hit->path + n,
+				COLUMN_LINE, line,
+				COLUMN_TEXT, hit->text,
+				COLUMN_PATH, hit->path,
+				COLUMN_LINE_NUM, hit->line,
+				COLUMN_OFFSET, hit->offset,
+				-1);
+			g_free(file);
+			g_free(line);
+		} else
+			done = TRUE;
+		find_hit_free(hit);
+	}
+	g_timer_destroy(timer);
+	
+	find_files_set_status(ff, !done);
+	if (done) {
+		ff->poll_id = 0;
+		find_files_free(ff);
+		find_files = NULL;
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+static gboolean find_files_start(GtkWidget *textview, gboolean replace)
+{
+	FindFiles *ff;
+	GError *err = NULL;
+	struct stat st;
+	gchar **names;
+	gint i, j;
+	
+	ff = g_new0(FindFiles, 1);
+	ff->ts = text_search_new(string_find,
+		(match_case ? TEXT_SEARCH_MATCH_CASE : 0)
+		| (use_regex ? TEXT_SEARCH_REGEX : 0), &err);
+	if (!ff->ts) {
+		run_dialog_message(gtk_widget_get_toplevel(textview),
+			GTK_MESSAGE_WARNING, "%s", err->message);
+		g_error_free(err);
+		g_free(ff);
+		return FALSE;
+	}
+	ff->folder = g_filename_from_utf8(string_folder, -1, NULL, NULL, NULL);
+	if (!ff->folder)
+		ff->folder = g_strdup(string_folder);
+	for (i = strlen(ff->folder); i > 1 && G_IS_DIR_SEPARATOR(ff->folder[i - 1]); i--)
+		ff->folder[i - 1] = '\0';
+	/* "*.c *.h" or "*.c;*.h"; none at all matches every file */
+	names = g_strsplit_set(string_names, " ;", -1);
+	ff->patterns = g_new0(GPatternSpec *, g_strv_length(names) + 1);
+	for (i = j = 0; names[i]; i++)
+		if (*names[i])
+			ff->patterns[j++] = g_pattern_spec_new(names[i]);
+	g_strfreev(names);
+	if (replace) {
+		ff->replacement = g_strdup(string_replace);
+		if (pub->fi->filename && g_stat(pub->fi->filename, &st) == 0) {
+			ff->skip = TRUE;
+			ff->skip_dev = st.st_dev;
+			ff->skip_ino = st.st_ino;
+		}
+	}
+	ff->queue = g_async_queue_new();
+	
+	/* the charset tables are set up on first use, which is no job for
+	   several threads at once */
+	get_encoding_items(get_encoding_code());
+	ff->pool = g_thread_pool_new((GFunc)find_files_search, ff,
+		find_files_threads(), FALSE, NULL);
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	if (ff->pool)
+		ff->walker = g_thread_try_new("find-files", find_files_walk_thread, ff, NULL);
+#else
+	if (ff->pool)
+		ff->walker = g_thread_create(find_files_walk_thread, ff, TRUE, NULL);
+#endif
+	if (!ff->walker) {
+		if (ff->pool)
+			g_thread_pool_free(ff->pool, TRUE, FALSE);
+		find_files_free(ff);
+		return FALSE;
+	}
+	
+	find_files = ff;
+	ff->poll_id = g_timeout_add(FIND_FILES_POLL,
+		(GSourceFunc)find_files_poll, ff);
+	find_files_set_status(ff, TRUE);
+	
+	return TRUE;
+}
+
+/* a big file is still being loaded when the row is activated */
+static gboolean find_files_jump(gpointer data)
+{
+	GtkTextBuffer *buffer = pub->mw->buffer;
+	GtkTextIter start;
+	
+	if (file_open_in_progress())
+		return TRUE;
+	gtk_text_buffer_get_iter_at_line(buffer, &start, jump_line - 1);
+	if (jump_offset < gtk_text_iter_get_chars_in_line(&start))
+		gtk_text_iter_set_line_offset(&start, jump_offset);
+	gtk_text_buffer_place_cursor(buffer, &start);
+	scroll_to_cursor(buffer, 0.25);
+	jump_id = 0;
+	
+	return FALSE;
+}
+
+/* opens the file unless it is the one in the editor, then goes to the line */
+static void cb_row_activated(GtkTreeView *treeview, GtkTreePath *path)
+{
+	GtkTreeModel *model = gtk_tree_view_get_model(treeview);
+	GtkTreeIter iter;
+	FileInfo *fi;
+	gchar *filename;
+	gint line, offset;
+	
+	gtk_tree_model_get_iter(model, &iter, path);
+	gtk_tree_model_get(model, &iter,
+		COLUMN_PATH, &filename,
+		COLUMN_LINE_NUM, &line,
+		COLUMN_OFFSET, &offset,
+		-1);
+	if (!pub->fi->filename || strcmp(pub->fi->filename, filename) != 0) {
+		if (check_text_modification()) {
+			g_free(filename);
+			return;
+		}
+		fi = g_malloc(sizeof(FileInfo));
+		fi->filename = filename;
+		fi->charset = NULL;
+		fi->charset_flag = FALSE;
+		fi->lineend = LF;
+		if (file_open_real(pub->mw->view, fi)) {
+			g_free(fi->filename);
+			g_free(fi);
+			return;
+		}
+		g_free(pub->fi);
+		pub->fi = fi;
+		force_call_cb_modified_changed(pub->mw->view);
+	} else
+		g_free(filename);
+	
+	if (line) {
+		jump_line = line;
+		jump_offset = offset;
+		if (!jump_id && find_files_jump(NULL))
+			jump_id = g_timeout_add(100, find_files_jump, NULL);
+	}
+	gtk_window_present(GTK_WINDOW(pub->mw->window));
+}
+
+static void cb_results_destroy(void)
+{
+	results_window = NULL;
+	find_files_stop();
+}
+
+static GtkWidget *create_results_window(void)
+{
+	GtkWidget *window;
+	GtkWidget *vbox, *hbox;
+	GtkWidget *scrolled;
+	GtkWidget *treeview;
+	GtkWidget *button;
+	GtkCellRenderer *renderer;
+	
+	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(window), _("Find in Files"));
+	gtk_window_set_transient_for(GTK_WINDOW(window),
+		GTK_WINDOW(pub->mw->window));
+	gtk_window_set_default_size(GTK_WINDOW(window), 600, 300);
+	g_signal_connect(G_OBJECT(window), "destroy",
+		G_CALLBACK(cb_results_destroy), NULL);
+	
+	vbox = gtk_vbox_new(FALSE, 8);
+	 gtk_container_set_border_width(GTK_CONTAINER(vbox), 8);
+	 gtk_container_add(GTK_CONTAINER(window), vbox);
+	scrolled = gtk_scrolled_window_new(NULL, NULL);
+	 gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+		GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	 gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(scrolled),
+		GTK_SHADOW_IN);
+	 gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
+	results_store = gtk_list_store_new(NUM_COLUMNS, G_TYPE_STRING,
+		G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT);
+	treeview = gtk_tree_view_new_with_model(GTK_TREE_MODEL(results_store));
+	 g_object_unref(results_store);
+	 g_signal_connect(G_OBJECT(treeview), "row-activated",
+		G_CALLBACK(cb_row_activated), NULL);
+	 gtk_container_add(GTK_CONTAINER(scrolled), treeview);
+	renderer = gtk_cell_renderer_text_new();
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(treeview), -1,
+		_("File"), renderer, "text", COLUMN_FILE, NULL);
+	renderer = gtk_cell_renderer_text_new();
+	 g_object_set(G_OBJECT(renderer), "xalign", 1.0, NULL);
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(treeview), -1,
+		_("Line"), renderer, "text", COLUMN_LINE, NULL);
+	renderer = gtk_cell_renderer_text_new();
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(treeview), -1,
+		_("Text"), renderer, "text", COLUMN_TEXT, NULL);
+	
+	hbox = gtk_hbox_new(FALSE, 8);
+	 gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+	results_label = gtk_label_new(NULL);
+	 gtk_misc_set_alignment(GTK_MISC(results_label), 0, 0.5);
+	 gtk_box_pack_start(GTK_BOX(hbox), results_label, TRUE, TRUE, 0);
+	button = gtk_button_new_from_stock(GTK_STOCK_STOP);
+	 g_signal_connect(G_OBJECT(button), "clicked",
+		G_CALLBACK(find_files_stop), NULL);
+	 gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
+	
+	gtk_widget_show_all(window);
+	
+	return window;
+}
+
+static GtkWidget *attach_entry(GtkWidget *table, gint row,
+	const gchar *label_str, const gchar *str)
+{
+	GtkWidget *label;
+	GtkWidget *entry;
+	
+	label = gtk_label_new_with_mnemonic(label_str);
+	 gtk_misc_set_alignment(GTK_MISC(label), 0, 0.5);
+	 gtk_table_attach_defaults(GTK_TABLE(table), label, 0, 1, row, row + 1);
+	entry = gtk_entry_new();
+	 gtk_table_attach_defaults(GTK_TABLE(table), entry, 1, 2, row, row + 1);
+	 gtk_label_set_mnemonic_widget(GTK_LABEL(label), entry);
+	 gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+	 if (str)
+		 gtk_entry_set_text(GTK_ENTRY(entry), str);
+	
+	return entry;
+}
+
+static GtkWidget *attach_check(GtkWidget *table, gint row,
+	const gchar *label_str, gboolean active)
+{
+	GtkWidget *check;
+	
+	check = gtk_check_button_new_with_mnemonic(label_str);
+	 gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check), active);
+	 gtk_table_attach_defaults(GTK_TABLE(table), check, 0, 2, row, row + 1);
+	
+	return check;
+}
+
+/* the folder of the file in the editor, or the current one */
+static gchar *get_default_folder(void)
+{
+	gchar *folder, *str;
+	
+	if (pub->fi->filename)
+		folder = g_path_get_dirname(pub->fi->filename);
+	else
+		folder = g_get_current_dir();
+	if (!g_path_is_absolute(folder)) {
+		str = g_get_current_dir();
+		g_free(folder);
+		folder = str;
+	}
+	str = g_filename_to_utf8(folder, -1, NULL, NULL, NULL);
+	g_free(folder);
+	
+	return str;
+}
+
+gint run_dialog_find_in_files(GtkWidget *textview, gint mode)
+{
+	GtkWidget *dialog;
+	GtkWidget *table;
+	GtkWidget *entry_find, *entry_replace = NULL, *entry_folder, *entry_names;
+	GtkWidget *check_case;
+#ifdef ENABLE_REGEX
+	GtkWidget *check_regex;
+#endif
+	gchar *folder;
+	gboolean is_dir;
+	gint res, row = 0;
+	
+	dialog = gtk_dialog_new_with_buttons(
+		mode ? _("Replace in Files") : _("Find in Files"),
+		GTK_WINDOW(gtk_widget_get_toplevel(textview)),
+		GTK_DIALOG_DESTROY_WITH_PARENT,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+		mode ? GTK_STOCK_FIND_AND_REPLACE : GTK_STOCK_FIND, GTK_RESPONSE_OK,
+		NULL);
+	gtk_dialog_set_has_separator(GTK_DIALOG(dialog), FALSE);
+	gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+	
+	table = gtk_table_new(mode + 5, 2, FALSE);
+	 gtk_table_set_row_spacings(GTK_TABLE(table), 8);
+	 gtk_table_set_col_spacings(GTK_TABLE(table), 8);
+	 gtk_container_set_border_width(GTK_CONTAINER(table), 8);
+	 gtk_box_pack_start(GTK_BOX(GTK_DIALOG(dialog)->vbox), table, FALSE, FALSE, 0);
+	entry_find = attach_entry(table, row++, _("Fi_nd what:"), string_find);
+	if (mode)
+		entry_replace = attach_entry(table, row++, _("Re_place with:"),
+			string_replace);
+	if (!string_folder)
+		string_folder = get_default_folder();
+	entry_folder = attach_entry(table, row++, _("In _folder:"), string_folder);
+	entry_names = attach_entry(table, row++, _("File _names:"),
+		string_names ? string_names : "*");
+	check_case = attach_check(table, row++, _("_Match case"), match_case);
+#ifdef ENABLE_REGEX
+	check_regex = attach_check(table, row++, _("Regular e_xpression"), use_regex);
+#endif
+	gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
+	gtk_widget_show_all(table);
+	
+	res = gtk_dialog_run(GTK_DIALOG(dialog));
+	if (res == GTK_RESPONSE_OK) {
+		g_free(string_find);
+		string_find = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_find)));
+		if (mode) {
+			g_free(string_replace);
+			string_replace = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_replace)));
+		}
+		g_free(string_folder);
+		string_folder = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_folder)));
+		g_free(string_names);
+		string_names = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_names)));
+		match_case = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_case));
+#ifdef ENABLE_REGEX
+		use_regex = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_regex));
+#endif
+	}
+	gtk_widget_destroy(dialog);
+	
+	if (res != GTK_RESPONSE_OK || !strlen(string_find))
+		return res;
+	folder = g_filename_from_utf8(string_folder, -1, NULL, NULL, NULL);
+	is_dir = folder && g_file_test(folder, G_FILE_TEST_IS_DIR);
+	g_free(folder);
+	if (!is_dir) {
+		run_dialog_message(gtk_widget_get_toplevel(textview),
+			GTK_MESSAGE_WARNING, _("Can't open folder '%s'"), string_folder);
+		return res;
+	}
+	/* files are rewritten in place, with no undo */
+	if (mode && run_dialog_message_question(gtk_widget_get_toplevel(textview),
+		_("Replace every match in the files under '%s'?"), string_folder)
+		!= GTK_RESPONSE_YES)
+		return res;
+	
+	find_files_stop();
+	if (results_window) {
+		gtk_list_store_clear(results_store);
+		gtk_window_present(GTK_WINDOW(results_window));
+	} else
+		results_window = create_results_window();
+	find_files_start(textview, mode);
+	
+	return res;
+}
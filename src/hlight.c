@@ -19,14 +19,42 @@
 
 #include <string.h>
 #include "leafpad.h"
+#include "textsearch.h"
 //#include <gtk/gtk.h>
 
+#define HLIGHT_SLICE 65536	/* chars tagged per idle call */
+
 static gboolean searched_flag = FALSE;
+static TextSearch *searched_ts = NULL;
+static GtkTextMark *searched_mark = NULL;	/* where tagging resumes */
+static GtkTextMark *searched_end = NULL;
+static guint searched_id = 0;
+static gint searched_count;	/* matches tagged by the idle pass */
+static HlightDoneFunc searched_done = NULL;
+
+void hlight_searched_cancel(void)
+{
+	if (searched_id) {
+		g_source_remove(searched_id);
+		searched_id = 0;
+	}
+	if (searched_mark) {
+		gtk_text_buffer_delete_mark(
+			gtk_text_mark_get_buffer(searched_mark), searched_mark);
+		gtk_text_buffer_delete_mark(
+			gtk_text_mark_get_buffer(searched_end), searched_end);
+		searched_mark = searched_end = NULL;
+	}
+	text_search_unref(searched_ts);
+	searched_ts = NULL;
+	searched_done = NULL;
+}
 
 static void cb_changed(GtkTextBuffer *buffer)
 {
 	GtkTextIter start, end;
 	
+	hlight_searched_cancel();
 	gtk_text_buffer_get_bounds(buffer, &start, &end);
 //	gtk_text_buffer_remove_tag_by_name(buffer,
 //		"searched", &start, &end);
@@ -49,6 +77,78 @@ static void cb_paste_clipboard(void)
 	}
 }
 
+static void cb_searched_tag(GtkTextIter *start, GtkTextIter *end)
+{
+	gtk_text_buffer_apply_tag_by_name(gtk_text_iter_get_buffer(start),
+		"searched", start, end);
+}
+
+/* the whole range from the top, a slice at a time */
+static gboolean cb_searched_idle(GtkTextBuffer *buffer)
+{
+	GtkTextIter start, end, bound, next;
+	
+	gtk_text_buffer_get_iter_at_mark(buffer, &start, searched_mark);
+	gtk_text_buffer_get_iter_at_mark(buffer, &bound, searched_end);
+	end = start;
+	gtk_text_iter_forward_chars(&end, HLIGHT_SLICE);
+	if (gtk_text_iter_compare(&end, &bound) > 0)
+		end = bound;
+	searched_count += text_search_foreach(searched_ts, &start, &end,
+		(TextSearchFunc)cb_searched_tag, NULL, &next);
+	if (!gtk_text_iter_equal(&end, &bound)) {
+		gtk_text_buffer_move_mark(buffer, searched_mark, &next);
+		return TRUE;
+	}
+	
+	searched_id = 0;
+	if (searched_done)
+		searched_done(searched_count);
+	hlight_searched_cancel();
+	
+	return FALSE;
+}
+
+/*
+ * Tags the matches in [start, end) that are on screen at once, then the
+ * rest in idle time. Returns how many matches are on screen; done_func,
+ * if any, gets the number in the whole range once the idle pass is over.
+ */
+gint hlight_searched_start(GtkTextView *view, TextSearch *ts,
+	const GtkTextIter *start, const GtkTextIter *end, HlightDoneFunc done_func)
+{
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(view);
+	GtkTextIter iter, bound;
+	GdkRectangle rect;
+	gint count = 0;
+	
+	hlight_searched_cancel();
+	gtk_text_buffer_get_bounds(buffer, &iter, &bound);
+	gtk_text_buffer_remove_all_tags(buffer, &iter, &bound);
+	searched_ts = text_search_ref(ts);
+	searched_count = 0;
+	searched_done = done_func;
+	
+	gtk_text_view_get_visible_rect(view, &rect);
+	gtk_text_view_get_line_at_y(view, &iter, rect.y, NULL);
+	gtk_text_view_get_line_at_y(view, &bound, rect.y + rect.height, NULL);
+	gtk_text_iter_forward_line(&bound);
+	if (gtk_text_iter_compare(&iter, start) < 0)
+		iter = *start;
+	if (gtk_text_iter_compare(&bound, end) > 0)
+		bound = *end;
+	if (gtk_text_iter_compare(&iter, &bound) < 0)
+		count = text_search_foreach(searched_ts, &iter, &bound,
+			(TextSearchFunc)cb_searched_tag, NULL, NULL);
+	
+	searched_mark = gtk_text_buffer_create_mark(buffer, NULL, start, TRUE);
+	searched_end = gtk_text_buffer_create_mark(buffer, NULL, end, FALSE);
+	searched_id = g_idle_add_full(G_PRIORITY_LOW,
+		(GSourceFunc)cb_searched_idle, buffer, NULL);
+	
+	return count;
+}
+
 gboolean hlight_check_searched(void)
 {
 	return searched_flag;
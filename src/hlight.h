@@ -22,6 +22,11 @@
 
 gboolean hlight_check_searched(void);
 gboolean hlight_toggle_searched(GtkTextBuffer *buffer);
+typedef void (*HlightDoneFunc)(gint count);
+
+gint hlight_searched_start(GtkTextView *view, TextSearch *ts,
+	const GtkTextIter *start, const GtkTextIter *end, HlightDoneFunc done_func);
+void hlight_searched_cancel(void);
 void hlight_init(GtkTextBuffer *buffer);
 
 #endif /* _HLIGHT_H */
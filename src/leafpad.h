@@ -42,11 +42,13 @@
 #include "linenum.h"
 #include "indent.h"
 #include "indentnavigation.h"
+#include "textsearch.h"
 #include "hlight.h"
 #include "selector.h"
 #include "file.h"
 #include "encoding.h"
 #include "search.h"
+#include "findfiles.h"
 #include "dialog.h"
 #include "about.h"
 #include "dnd.h"
@@ -26,6 +26,21 @@ static gboolean line_number_visible = FALSE;
 #define	margin 5
 #define	submargin 2
 
+/*
+ * Each number is shaped into a layout once and kept while it is likely to
+ * be drawn again, so a line costs one paint. The cache is dropped on a new
+ * font or colors, and when it holds a few screens' worth. The gutter width
+ * follows the line count through the buffer's edits, so an expose only
+ * paints.
+ */
+#define NUMBER_CACHE_MAX 1024
+
+static GHashTable *number_layouts = NULL;	/* by number */
+static PangoAttrList *number_attrs = NULL;
+static gint digit_max_width;
+static gint number_digits = 0;	/* of the highest number there is room for */
+static gint number_width = 0;	/* of the numbers, without the margins */
+
 static gint calculate_min_number_window_width(GtkWidget *widget)
 {
 	PangoLayout *layout;
@@ -42,6 +57,115 @@ static gint calculate_min_number_window_width(GtkWidget *widget)
 	return width;
 }
 
+static gint count_digits(gint n)
+{
+	gint digits = 1;
+	
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+	
+	return digits;
+}
+
+static void update_number_width(GtkTextView *text_view)
+{
+	gint digits, width;
+	
+	/* the line count is kept by the buffer, so this is cheap */
+	digits = count_digits(MAX(99,
+		gtk_text_buffer_get_line_count(gtk_text_view_get_buffer(text_view))));
+	if (digits == number_digits)
+		return;
+	number_digits = digits;
+	width = MAX(digits * digit_max_width, min_number_window_width);
+	if (width != number_width) {
+		number_width = width;
+		if (line_number_visible)
+			gtk_text_view_set_border_window_size(text_view,
+				GTK_TEXT_WINDOW_LEFT, number_width + margin + submargin);
+	}
+}
+
+static void clear_number_layouts(void)
+{
+	if (number_layouts)
+		g_hash_table_destroy(number_layouts);
+	number_layouts = g_hash_table_new_full(NULL, NULL,
+		NULL, g_object_unref);
+}
+
+/* on a new font or new colors */
+static void cb_style_set(GtkWidget *widget)
+{
+	PangoLayout *layout;
+	PangoAttribute *attr;
+	gchar str[2] = "0";
+	gint i, width;
+	
+	if (number_attrs)
+		pango_attr_list_unref(number_attrs);
+	number_attrs = pango_attr_list_new();
+	attr = pango_attr_foreground_new(
+		widget->style->text_aa->red,
+		widget->style->text_aa->green,
+		widget->style->text_aa->blue);
+	attr->start_index = 0;
+	attr->end_index = G_MAXUINT;
+	pango_attr_list_insert(number_attrs, attr);
+	
+	clear_number_layouts();
+	
+	digit_max_width = 0;
+	layout = gtk_widget_create_pango_layout(widget, NULL);
+	for (i = 0; i < 10; i++) {
+		str[0] = '0' + i;
+		pango_layout_set_text(layout, str, 1);
+		pango_layout_get_pixel_size(layout, &width, NULL);
+		digit_max_width = MAX(digit_max_width, width);
+	}
+	g_object_unref(G_OBJECT(layout));
+	
+	min_number_window_width = calculate_min_number_window_width(widget);
+	number_digits = 0;
+	update_number_width(GTK_TEXT_VIEW(widget));
+}
+
+static void cb_insert_text(GtkTextBuffer *buffer, GtkTextIter *iter,
+	gchar *str, gint len, GtkTextView *text_view)
+{
+	update_number_width(text_view);
+}
+
+static void cb_delete_range(GtkTextBuffer *buffer, GtkTextIter *start,
+	GtkTextIter *end, GtkTextView *text_view)
+{
+	update_number_width(text_view);
+}
+
+/* right aligned at x */
+static void draw_number(GtkWidget *widget, GdkWindow *win, gint x, gint y,
+	gint n)
+{
+	PangoLayout *layout;
+	gchar str[16];
+	gint width;
+	
+	layout = g_hash_table_lookup(number_layouts, GINT_TO_POINTER(n));
+	if (!layout) {
+		if (g_hash_table_size(number_layouts) >= NUMBER_CACHE_MAX)
+			clear_number_layouts();
+		g_snprintf(str, sizeof(str), "%d", n);
+		layout = gtk_widget_create_pango_layout(widget, str);
+		pango_layout_set_attributes(layout, number_attrs);
+		g_hash_table_insert(number_layouts, GINT_TO_POINTER(n), layout);
+	}
+	pango_layout_get_pixel_size(layout, &width, NULL);
+	gtk_paint_layout(widget->style, win, GTK_WIDGET_STATE(widget),
+		FALSE, NULL, widget, NULL, x - width, y, layout);
+}
+
 /* taken from gedit and gtksourceview */
 /* originated from gtk+/tests/testtext.c */
 
@@ -114,18 +238,11 @@ line_numbers_expose (GtkWidget      *widget,
 	GtkTextView *text_view;
 	GdkWindow *win;
 //	GtkStyle *style;
-	PangoLayout *layout;
-	PangoAttrList *alist;
-	PangoAttribute *attr;
 	GArray *numbers;
 	GArray *pixels;
 	gint y1, y2;
 	gint count;
-	gint layout_width;
-	gint justify_width = 0;
 	gint i;
-//	gchar *str;
-	gchar str [8];  /* we don't expect more than ten million lines */
 	GdkGC *gc;
 	gint height;
 	
@@ -203,42 +320,6 @@ DV({g_print("Painting line numbers %d - %d\n",
 			g_array_index(numbers, gint, 0),
 			g_array_index(numbers, gint, count - 1));	});
 	
-	layout = gtk_widget_create_pango_layout (widget, "");
-	
-//	str = g_strdup_printf ("%d", gtk_text_buffer_get_line_count(text_view->buffer));
-	g_snprintf (str, sizeof (str),
-			"%d", MAX (99, gtk_text_buffer_get_line_count(text_view->buffer)));
-	pango_layout_set_text (layout, str, -1);
-//	g_free (str);
-	
-	pango_layout_get_pixel_size (layout, &layout_width, NULL);
-	
-	min_number_window_width = calculate_min_number_window_width(widget);
-	if (layout_width > min_number_window_width)
-		gtk_text_view_set_border_window_size (text_view,
-			GTK_TEXT_WINDOW_LEFT, layout_width + margin + submargin);
-	else {
-//		if ((gtk_text_view_get_border_window_size (text_view, GTK_TEXT_WINDOW_LEFT) - 5) > layout_width) {
-			gtk_text_view_set_border_window_size (text_view,
-				GTK_TEXT_WINDOW_LEFT, min_number_window_width + margin + submargin);
-//		}
-		justify_width = min_number_window_width - layout_width;
-	}
-	
-	pango_layout_set_width (layout, layout_width);
-	pango_layout_set_alignment (layout, PANGO_ALIGN_RIGHT);
-	
-	alist = pango_attr_list_new();
-	attr = pango_attr_foreground_new(
-		widget->style->text_aa->red,
-		widget->style->text_aa->green,
-		widget->style->text_aa->blue);
-	attr->start_index = 0;
-	attr->end_index = G_MAXUINT;
-	pango_attr_list_insert(alist, attr);
-	pango_layout_set_attributes(layout, alist);
-	pango_attr_list_unref(alist);
-	
 	/* Draw fully internationalized numbers! */
 	
 	i = 0;
@@ -253,27 +334,14 @@ DV({g_print("Painting line numbers %d - %d\n",
 		                                       NULL,
 		                                       &pos);
 		
-//		str = g_strdup_printf ("%d", g_array_index (numbers, gint, i) + 1);
-		g_snprintf (str, sizeof (str),
-				"%d", g_array_index (numbers, gint, i) + 1);
-		
-		pango_layout_set_text (layout, str, -1);
-		
-		gtk_paint_layout (widget->style,
-		                  win,
-		                  GTK_WIDGET_STATE (widget),
-		                  FALSE,
-		                  NULL,
-		                  widget,
-		                  NULL,
+		draw_number (widget, win,
 #if GTK_CHECK_VERSION(2, 6, 0)  // Is this solution???
-		                  layout_width + justify_width + margin / 2 + 1,
+		             number_width + margin / 2 + 1,
 #else
-		                  layout_width + justify_width + margin / 2,
+		             number_width + margin / 2,
 #endif
-		                  pos,
-		                  layout);
-//		g_free (str);
+		             pos,
+		             g_array_index (numbers, gint, i) + 1);
 		
 		++i;
 	}
@@ -281,7 +349,6 @@ DV({g_print("Painting line numbers %d - %d\n",
 	g_array_free (pixels, TRUE);
 	g_array_free (numbers, TRUE);
 	
-	g_object_unref (G_OBJECT (layout));
 //	g_object_ref (G_OBJECT (style));
 	
 	/* don't stop emission, need to draw children */
@@ -292,8 +359,7 @@ DV({g_print("Painting line numbers %d - %d\n",
 	gdk_gc_set_foreground(gc, widget->style->base);
 	gdk_window_get_geometry(event->window, NULL, NULL, NULL, &height, NULL);
 	gdk_draw_rectangle(event->window, gc, TRUE,
-		line_number_visible ?
-		layout_width + justify_width + margin : 0,
+		line_number_visible ? number_width + margin : 0,
 		0, submargin,
 		height);
 	
@@ -306,10 +372,12 @@ void show_line_numbers(GtkWidget *text_view, gboolean visible)
 {
 	line_number_visible = visible;
 	if (visible) {
+		number_digits = 0;
+		update_number_width(GTK_TEXT_VIEW(text_view));
 		gtk_text_view_set_border_window_size(
 			GTK_TEXT_VIEW(text_view),
 			GTK_TEXT_WINDOW_LEFT,
-			min_number_window_width + margin + submargin);
+			number_width + margin + submargin);
 	} else {
 		gtk_text_view_set_border_window_size(
 			GTK_TEXT_VIEW(text_view),
@@ -320,7 +388,24 @@ void show_line_numbers(GtkWidget *text_view, gboolean visible)
 
 void linenum_init(GtkWidget *text_view)
 {
-	min_number_window_width = calculate_min_number_window_width(text_view);
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+	
+	cb_style_set(text_view);
+	g_signal_connect_after(
+		G_OBJECT(text_view),
+		"style-set",
+		G_CALLBACK(cb_style_set),
+		NULL);
+	g_signal_connect_after(
+		G_OBJECT(buffer),
+		"insert-text",
+		G_CALLBACK(cb_insert_text),
+		text_view);
+	g_signal_connect_after(
+		G_OBJECT(buffer),
+		"delete-range",
+		G_CALLBACK(cb_delete_range),
+		text_view);
 	g_signal_connect(
 		G_OBJECT(text_view),
 		"expose_event",
@@ -36,6 +36,10 @@ typedef struct {
 	gboolean wordwrap;
 	gboolean linenumbers;
 	gboolean autoindent;
+	gint undomemory;	/* KiB, 0 for no limit */
+	gint undolevels;	/* 0 for no limit */
+	gboolean undocompress;
+	gboolean undojournal;
 } Conf;
 
 static void load_config_file(Conf *conf)
@@ -72,6 +76,14 @@ static void load_config_file(Conf *conf)
 			conf->linenumbers = atoi(buf);
 			fgets(buf, sizeof(buf), fp);
 			conf->autoindent = atoi(buf);
+			if (fgets(buf, sizeof(buf), fp))
+				conf->undomemory = atoi(buf);
+			if (fgets(buf, sizeof(buf), fp))
+				conf->undolevels = atoi(buf);
+			if (fgets(buf, sizeof(buf), fp))
+				conf->undocompress = atoi(buf);
+			if (fgets(buf, sizeof(buf), fp))
+				conf->undojournal = atoi(buf);
 		}
 		g_strfreev(num);
 	}
@@ -86,6 +98,9 @@ void save_config_file(void)
 	gint width, height;
 	gchar *fontname;
 	gboolean wordwrap, linenumbers, autoindent;
+	gsize undomemory;
+	guint undolevels;
+	gboolean undocompress;
 	
 	gtk_window_get_size(GTK_WINDOW(pub->mw->window), &width, &height);
 	fontname = get_font_name_from_widget(pub->mw->view);
@@ -99,6 +114,7 @@ void save_config_file(void)
 	autoindent = gtk_check_menu_item_get_active(
 		GTK_CHECK_MENU_ITEM(gtk_item_factory_get_item(ifactory,
 			"/Options/Auto Indent")));
+	undo_get_memory_limit(&undomemory, &undolevels, &undocompress);
 	
 #if GLIB_CHECK_VERSION(2, 6, 0)
 	path = g_build_filename(g_get_user_config_dir(), PACKAGE, NULL);
@@ -130,6 +146,10 @@ void save_config_file(void)
 	fprintf(fp, "%d\n", wordwrap);
 	fprintf(fp, "%d\n", linenumbers);
 	fprintf(fp, "%d\n", autoindent);
+	fprintf(fp, "%d\n", (gint)(undomemory / 1024));
+	fprintf(fp, "%u\n", undolevels);
+	fprintf(fp, "%d\n", undocompress);
+	fprintf(fp, "%d\n", undo_get_journal());
 	fclose(fp);
 	
 	g_free(fontname);
@@ -275,12 +295,31 @@ static void parse_args(gint argc, gchar **argv, FileInfo *fi)
 #endif
 }
 
+/* a big file is still being loaded when the main loop starts */
+static gboolean jump_to_linenum(gpointer data)
+{
+	GtkTextIter iter;
+	
+	if (file_open_in_progress())
+		return TRUE;
+	gtk_text_buffer_get_iter_at_line(pub->mw->buffer, &iter, jump_linenum - 1);
+	gtk_text_buffer_place_cursor(pub->mw->buffer, &iter);
+//	gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(textview), &iter, 0.1, FALSE, 0.5, 0.5);
+	scroll_to_cursor(pub->mw->buffer, 0.25);
+	
+	return FALSE;
+}
+
 gint main(gint argc, gchar **argv)
 {
 	Conf *conf;
 	GtkItemFactory *ifactory;
 	gchar *stdin_data = NULL;
 	
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	bind_textdomain_codeset(PACKAGE, "UTF-8");
 	textdomain(PACKAGE);
@@ -310,6 +349,10 @@ gint main(gint argc, gchar **argv)
 	conf->wordwrap    = FALSE;
 	conf->linenumbers = FALSE;
 	conf->autoindent  = FALSE;
+	conf->undomemory  = 32 * 1024;
+	conf->undolevels  = 0;
+	conf->undocompress = TRUE;
+	conf->undojournal = FALSE;
 	
 	load_config_file(conf);
 	
@@ -328,6 +371,9 @@ gint main(gint argc, gchar **argv)
 	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(
 		gtk_item_factory_get_widget(ifactory, "/Options/Auto Indent")),
 		conf->autoindent);
+	undo_set_memory_limit((gsize)MAX(conf->undomemory, 0) * 1024,
+		MAX(conf->undolevels, 0), conf->undocompress);
+	undo_set_journal(conf->undojournal);
 	
 	gtk_widget_show_all(pub->mw->window);
 	g_free(conf->fontname);
@@ -340,7 +386,9 @@ gint main(gint argc, gchar **argv)
 	hlight_init(pub->mw->buffer);
 	undo_init(pub->mw->view,
 		gtk_item_factory_get_widget(ifactory, "/Edit/Undo"),
-		gtk_item_factory_get_widget(ifactory, "/Edit/Redo"));
+		gtk_item_factory_get_widget(ifactory, "/Edit/Redo"),
+		gtk_item_factory_get_widget(ifactory, "/Edit/Older Branch"),
+		gtk_item_factory_get_widget(ifactory, "/Edit/Newer Branch"));
 //	hlight_init(pub->mw->buffer);
 	dnd_init(pub->mw->view);
 	
@@ -369,12 +417,10 @@ gint main(gint argc, gchar **argv)
 	}
 	
 	if (jump_linenum) {
-		GtkTextIter iter;
-		
-		gtk_text_buffer_get_iter_at_line(pub->mw->buffer, &iter, jump_linenum - 1);
-		gtk_text_buffer_place_cursor(pub->mw->buffer, &iter);
-//		gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(textview), &iter, 0.1, FALSE, 0.5, 0.5);
-		scroll_to_cursor(pub->mw->buffer, 0.25);
+		if (file_open_in_progress())
+			g_timeout_add(100, jump_to_linenum, NULL);
+		else
+			jump_to_linenum(NULL);
 	}
 	
 	set_main_window_title();
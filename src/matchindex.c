@@ -0,0 +1,305 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Keeps the char offset of every match in the buffer, sorted, so that Find
+ * Next and Previous are a binary search away. Matches don't overlap, each
+ * one being looked for from the end of the one before, as Find Next and
+ * Replace All do. It is built in idle time and patched on each edit,
+ * rescanning from the changed text until the matches fall in step with
+ * the ones already known.
+ */
+
+#include <gtk/gtk.h>
+#include "matchindex.h"
+
+#define MATCH_INDEX_SLICE (1 << 18)	/* chars indexed per idle call */
+
+struct _MatchIndex {
+	GtkTextBuffer *buffer;
+	TextSearch *ts;	/* not owned */
+	gint len;	/* of the needle, in chars */
+	GArray *starts;
+	gint done;	/* every match starting before this is in starts */
+	gint length;	/* of the buffer as last seen */
+	guint idle_id;
+	MatchIndexFunc done_func;
+	gpointer data;
+};
+
+/* the first entry not before offset */
+static guint match_index_lower(MatchIndex *mi, gint offset)
+{
+	guint lo = 0, hi = mi->starts->len, mid;
+	
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (g_array_index(mi->starts, gint, mid) < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	return lo;
+}
+
+static void match_index_remove_range(MatchIndex *mi, gint from, gint to)
+{
+	guint i = match_index_lower(mi, from), j = match_index_lower(mi, to);
+	
+	if (j > i)
+		g_array_remove_range(mi->starts, i, j - i);
+}
+
+/* where looking for the next match resumes, from offset on */
+static gint match_index_chain_point(MatchIndex *mi, gint offset)
+{
+	guint i = match_index_lower(mi, offset);
+	
+	if (i && g_array_index(mi->starts, gint, i - 1) + mi->len > offset)
+		return g_array_index(mi->starts, gint, i - 1) + mi->len;
+	
+	return offset;
+}
+
+static void match_index_shift(MatchIndex *mi, gint from, gint delta)
+{
+	guint i;
+	
+	for (i = match_index_lower(mi, from); i < mi->starts->len; i++)
+		g_array_index(mi->starts, gint, i) += delta;
+}
+
+/* adds the matches starting in [from, to), which must not be there yet */
+static void match_index_scan(MatchIndex *mi, gint from, gint to)
+{
+	GtkTextIter start, end;
+	GArray *found;
+	gchar *text;
+	
+	if (from >= to)
+		return;
+	gtk_text_buffer_get_iter_at_offset(mi->buffer, &start, from);
+	gtk_text_buffer_get_iter_at_offset(mi->buffer, &end, to + mi->len - 1);
+	text = gtk_text_iter_get_slice(&start, &end);
+	found = g_array_new(FALSE, FALSE, sizeof(gint));
+	text_search_scan_offsets(mi->ts, text, from, to, found);
+	if (found->len)
+		g_array_insert_vals(mi->starts, match_index_lower(mi, from),
+			found->data, found->len);
+	g_array_free(found, TRUE);
+	g_free(text);
+}
+
+/*
+ * Puts back the matches from from on, after an edit that changed the text
+ * before changed. The entries past it were found going on from old_end,
+ * so they hold again once a new match lands on one of them, or the search
+ * resumes past both changed and old_end.
+ */
+static void match_index_rechain(MatchIndex *mi, gint from, gint changed,
+	gint old_end)
+{
+	GtkTextIter start, end;
+	GArray *found;
+	gchar *text;
+	gint x = from, to, p, s, span = changed - from + mi->len * 16;
+	gboolean in_step = FALSE;
+	guint i, k;
+	
+	while (!in_step && x < mi->done && (x < changed || x < old_end)) {
+		to = MIN(x + span, mi->done);
+		gtk_text_buffer_get_iter_at_offset(mi->buffer, &start, x);
+		gtk_text_buffer_get_iter_at_offset(mi->buffer, &end, to + mi->len - 1);
+		text = gtk_text_iter_get_slice(&start, &end);
+		found = g_array_new(FALSE, FALSE, sizeof(gint));
+		text_search_scan_offsets(mi->ts, text, x, to, found);
+		g_free(text);
+		for (k = 0; k < found->len && (x < changed || x < old_end); k++) {
+			p = g_array_index(found, gint, k);
+			/* old entries this one covers go */
+			i = match_index_lower(mi, x);
+			while (i < mi->starts->len
+				&& (s = g_array_index(mi->starts, gint, i)) < p + mi->len) {
+				if (s == p)
+					break;
+				old_end = MAX(old_end, s + mi->len);
+				g_array_remove_index(mi->starts, i);
+			}
+			if (i < mi->starts->len && s == p) {
+				in_step = TRUE;
+				break;
+			}
+			g_array_insert_val(mi->starts, i, p);
+			x = p + mi->len;
+		}
+		if (k == found->len)
+			x = MAX(x, to);
+		g_array_free(found, TRUE);
+		span *= 2;
+	}
+}
+
+static gboolean cb_idle(MatchIndex *mi)
+{
+	gint to = MIN(mi->done + MATCH_INDEX_SLICE, mi->length);
+	
+	match_index_scan(mi, match_index_chain_point(mi, mi->done), to);
+	mi->done = to;
+	if (mi->done < mi->length)
+		return TRUE;
+	
+	mi->idle_id = 0;
+	if (mi->done_func)
+		mi->done_func(mi, mi->data);
+	
+	return FALSE;
+}
+
+static void match_index_resume(MatchIndex *mi)
+{
+	if (!mi->idle_id && mi->done < mi->length)
+		mi->idle_id = g_idle_add_full(G_PRIORITY_LOW,
+			(GSourceFunc)cb_idle, mi, NULL);
+}
+
+/* forgets from offset on, for the idle pass to pick up again */
+static void match_index_truncate(MatchIndex *mi, gint offset)
+{
+	g_array_set_size(mi->starts, match_index_lower(mi, offset));
+	mi->done = offset;
+	match_index_resume(mi);
+}
+
+static void cb_insert_text(GtkTextBuffer *buffer, GtkTextIter *iter,
+	gchar *str, gint len, MatchIndex *mi)
+{
+	gint n = g_utf8_strlen(str, len);
+	gint o = gtk_text_iter_get_offset(iter) - n;
+	gint a = MAX(o - mi->len + 1, 0);	/* first start the text can affect */
+	gint old_end = o + n;
+	guint i;
+	
+	mi->length += n;
+	if (!mi->len)
+		return;
+	/* a match the text went into is gone; the next one followed its end */
+	i = match_index_lower(mi, o);
+	if (i > match_index_lower(mi, a))
+		old_end = g_array_index(mi->starts, gint, i - 1) + mi->len + n;
+	match_index_remove_range(mi, a, o);
+	match_index_shift(mi, o, n);
+	/* with a one char needle a == o, and text typed at done is scanned */
+	if (mi->done < a || (mi->done == a && a < o))
+		return;
+	if (mi->done >= o) {
+		if (n > MATCH_INDEX_SLICE) {
+			match_index_truncate(mi, a);
+			return;
+		}
+		mi->done += n;
+	}
+	match_index_rechain(mi, match_index_chain_point(mi, a), o + n, old_end);
+}
+
+static void cb_delete_range(GtkTextBuffer *buffer, GtkTextIter *start_iter,
+	GtkTextIter *end_iter, MatchIndex *mi)
+{
+	gint length = gtk_text_buffer_get_char_count(buffer);
+	gint n = mi->length - length;
+	gint o = gtk_text_iter_get_offset(start_iter);
+	gint a = MAX(o - mi->len + 1, 0);
+	gint old_end = o;
+	guint i;
+	
+	mi->length = length;
+	if (!mi->len)
+		return;
+	i = match_index_lower(mi, o + n);
+	if (i > match_index_lower(mi, a))
+		old_end = MAX(g_array_index(mi->starts, gint, i - 1) + mi->len - n, o);
+	match_index_remove_range(mi, a, o + n);
+	match_index_shift(mi, o + n, -n);
+	if (mi->done <= a)
+		return;
+	if (mi->done > o)
+		mi->done = MAX(mi->done - n, o);
+	match_index_rechain(mi, match_index_chain_point(mi, a), o, old_end);
+}
+
+/* done_func is called once every match is known */
+MatchIndex *match_index_new(GtkTextBuffer *buffer, TextSearch *ts,
+	MatchIndexFunc done_func, gpointer data)
+{
+	MatchIndex *mi;
+	
+	mi = g_new0(MatchIndex, 1);
+	mi->buffer = buffer;
+	mi->ts = ts;
+	mi->len = text_search_get_length(ts);
+	mi->starts = g_array_new(FALSE, FALSE, sizeof(gint));
+	mi->length = gtk_text_buffer_get_char_count(buffer);
+	mi->done_func = done_func;
+	mi->data = data;
+	g_signal_connect_after(G_OBJECT(buffer), "insert-text",
+		G_CALLBACK(cb_insert_text), mi);
+	g_signal_connect_after(G_OBJECT(buffer), "delete-range",
+		G_CALLBACK(cb_delete_range), mi);
+	if (mi->len)
+		match_index_resume(mi);
+	else
+		mi->done = mi->length;
+	
+	return mi;
+}
+
+void match_index_free(MatchIndex *mi)
+{
+	if (!mi)
+		return;
+	if (mi->idle_id)
+		g_source_remove(mi->idle_id);
+	g_signal_handlers_disconnect_by_func(G_OBJECT(mi->buffer),
+		G_CALLBACK(cb_insert_text), mi);
+	g_signal_handlers_disconnect_by_func(G_OBJECT(mi->buffer),
+		G_CALLBACK(cb_delete_range), mi);
+	g_array_free(mi->starts, TRUE);
+	g_free(mi);
+}
+
+gboolean match_index_is_complete(MatchIndex *mi)
+{
+	return mi->done >= mi->length;
+}
+
+gint match_index_get_count(MatchIndex *mi)
+{
+	return mi->starts->len;
+}
+
+gint match_index_nth(MatchIndex *mi, gint n)
+{
+	return g_array_index(mi->starts, gint, n);
+}
+
+/* the position of the first match starting at or after offset */
+gint match_index_find(MatchIndex *mi, gint offset)
+{
+	return match_index_lower(mi, offset);
+}
@@ -0,0 +1,36 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MATCHINDEX_H
+#define _MATCHINDEX_H
+
+#include "textsearch.h"
+
+typedef struct _MatchIndex MatchIndex;
+typedef void (*MatchIndexFunc)(MatchIndex *mi, gpointer data);
+
+MatchIndex *match_index_new(GtkTextBuffer *buffer, TextSearch *ts,
+	MatchIndexFunc done_func, gpointer data);
+void match_index_free(MatchIndex *mi);
+gboolean match_index_is_complete(MatchIndex *mi);
+gint match_index_get_count(MatchIndex *mi);
+gint match_index_nth(MatchIndex *mi, gint n);
+gint match_index_find(MatchIndex *mi, gint offset);
+
+#endif /* _MATCHINDEX_H */
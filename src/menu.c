@@ -25,6 +25,9 @@ static GtkWidget *menu_item_cut;
 static GtkWidget *menu_item_copy;
 static GtkWidget *menu_item_paste;
 static GtkWidget *menu_item_delete;
+static GtkWidget *menu_item_edit;
+static GtkWidget *menu_item_replace;
+static GtkWidget *menu_item_replace_in_files;
 
 static GtkItemFactoryEntry menu_items[] =
 {
@@ -60,6 +63,10 @@ static GtkItemFactoryEntry menu_items[] =
 		G_CALLBACK(on_edit_undo), 0, "<StockItem>", GTK_STOCK_UNDO },
 	{ N_("/Edit/_Redo"), "<shift><control>Z",
 		G_CALLBACK(on_edit_redo), 0, "<StockItem>", GTK_STOCK_REDO },
+	{ N_("/Edit/Ol_der Branch"), "<alt><control>Z",
+		G_CALLBACK(on_edit_older_branch), 0 },
+	{ N_("/Edit/Ne_wer Branch"), "<shift><alt><control>Z",
+		G_CALLBACK(on_edit_newer_branch), 0 },
 	{ "/Edit/---", NULL,
 		NULL, 0, "<Separator>" },
 	{ N_("/Edit/Cu_t"), "<control>X",
@@ -99,6 +106,10 @@ static GtkItemFactoryEntry menu_items[] =
 		G_CALLBACK(on_search_find_previous), 0 },
 	{ N_("/Search/_Replace..."), "<control>H",
 		G_CALLBACK(on_search_replace), 0, "<StockItem>", GTK_STOCK_FIND_AND_REPLACE },
+	{ N_("/Search/Find in F_iles..."), "<shift><control>F",
+		G_CALLBACK(on_search_find_in_files), 0 },
+	{ N_("/Search/Replace in Fil_es..."), "<shift><control>H",
+		G_CALLBACK(on_search_replace_in_files), 0 },
 	{ "/Search/---", NULL,
 		NULL, 0, "<Separator>" },
 	{ N_("/Search/_Jump To..."), "<control>J",
@@ -148,6 +159,14 @@ void menu_sensitivity_from_selection_bound(gboolean is_bound_exist)
 	gtk_widget_set_sensitive(menu_item_delete, is_bound_exist);
 }
 
+/* everything that can change the text, while it is still loading */
+void menu_sensitivity_from_editable(gboolean is_editable)
+{
+	gtk_widget_set_sensitive(menu_item_edit,    is_editable);
+	gtk_widget_set_sensitive(menu_item_replace, is_editable);
+	gtk_widget_set_sensitive(menu_item_replace_in_files, is_editable);
+}
+
 //void menu_sensitivity_from_clipboard(gboolean is_clipboard_exist)
 void menu_sensitivity_from_clipboard(void)
 {
@@ -213,6 +232,10 @@ GtkWidget *create_menu_bar(GtkWidget *window)
 	menu_item_copy   = gtk_item_factory_get_widget(ifactory, "/Edit/Copy");
 	menu_item_paste  = gtk_item_factory_get_widget(ifactory, "/Edit/Paste");
 	menu_item_delete = gtk_item_factory_get_widget(ifactory, "/Edit/Delete");
+	menu_item_edit   = gtk_item_factory_get_widget(ifactory, "/Edit");
+	menu_item_replace = gtk_item_factory_get_widget(ifactory, "/Search/Replace...");
+	menu_item_replace_in_files =
+		gtk_item_factory_get_widget(ifactory, "/Search/Replace in Files...");
 	menu_sensitivity_from_selection_bound(FALSE);
 	
 	return gtk_item_factory_get_widget(ifactory, "<main>");
@@ -223,6 +246,7 @@ void menu_populate_popup(GtkTextView *view, GtkMenu *menu, gpointer data)
 	GList *items = gtk_container_get_children (GTK_CONTAINER(menu));
 	GtkMenuItem *paste_item = g_list_nth_data(items, 2);
 	gboolean can_paste = gtk_widget_get_sensitive(GTK_WIDGET(paste_item));
+	gboolean editable = gtk_text_view_get_editable(view);
 	GtkWidget *menuitem;
 
 	menuitem = gtk_image_menu_item_new_with_mnemonic (_("Paste with i_ndent"));
@@ -241,6 +265,7 @@ void menu_populate_popup(GtkTextView *view, GtkMenu *menu, gpointer data)
 	menuitem = gtk_image_menu_item_new_with_mnemonic (_("_Indent selection"));
 	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(menuitem), gtk_image_new_from_stock(GTK_STOCK_INDENT, GTK_ICON_SIZE_MENU));
 
+	gtk_widget_set_sensitive(menuitem, editable);
 	g_signal_connect(menuitem, "activate", G_CALLBACK(on_popup_indent), NULL);
 	gtk_widget_show(menuitem);
 	gtk_menu_shell_insert(GTK_MENU_SHELL(menu), menuitem, 8);
@@ -248,6 +273,7 @@ void menu_populate_popup(GtkTextView *view, GtkMenu *menu, gpointer data)
 	menuitem = gtk_image_menu_item_new_with_mnemonic (_("_Unindent selection"));
 	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(menuitem), gtk_image_new_from_stock(GTK_STOCK_UNINDENT, GTK_ICON_SIZE_MENU));
 
+	gtk_widget_set_sensitive(menuitem, editable);
 	g_signal_connect(menuitem, "activate", G_CALLBACK(on_popup_unindent), NULL);
 	gtk_widget_show(menuitem);
 	gtk_menu_shell_insert(GTK_MENU_SHELL(menu), menuitem, 9);
@@ -257,6 +283,7 @@ void menu_populate_popup(GtkTextView *view, GtkMenu *menu, gpointer data)
 	gtk_menu_shell_insert(GTK_MENU_SHELL(menu), menuitem, 10);
 
 	menuitem = gtk_menu_item_new_with_mnemonic (_("_Strip trailing whitespace"));
+	gtk_widget_set_sensitive(menuitem, editable);
 	g_signal_connect(menuitem, "activate", G_CALLBACK(on_popup_strip_trailing_whitespace), NULL);
 	gtk_widget_show(menuitem);
 	gtk_menu_shell_insert(GTK_MENU_SHELL(menu), menuitem, 11);
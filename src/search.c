@@ -29,7 +29,9 @@
 #include "utils.h"
 #include "view.h"
 #include "undo.h"
-#include "gtksourceiter.h"
+#include "textsearch.h"
+#include "matchindex.h"
+#include "window.h"
 #include "search.h"
 #include "hlight.h"
 
@@ -40,93 +42,242 @@
 static gchar *string_find    = NULL;
 static gchar *string_replace = NULL;
 static gboolean match_case, replace_all;//, replace_mode = FALSE;
+static gboolean use_regex = FALSE;
+static TextSearch *text_search = NULL;
+static MatchIndex *match_index = NULL;
 
-static gboolean hlight_searched_strings(GtkTextBuffer *buffer, gchar *str)
+enum {
+	SCOPE_DOCUMENT,
+	SCOPE_SELECTION,
+	SCOPE_LINES,
+	SCOPE_VISIBLE
+};
+
+static gint search_scope = SCOPE_DOCUMENT;
+static GtkTextMark *scope_start = NULL, *scope_end = NULL;
+static gchar *scope_str[] = {
+	N_("Whole document"),
+	N_("Selection"),
+	N_("Selected lines"),
+	N_("Visible area")
+};
+
+/* the prepared needle lasts until the string or an option changes */
+static gboolean needle_changed = TRUE;
+
+static TextSearch *get_text_search(GError **error)
 {
-	GtkTextIter iter, start, end;
-	gboolean res, retval = FALSE;
-	GtkSourceSearchFlags search_flags =
-		GTK_SOURCE_SEARCH_VISIBLE_ONLY | GTK_SOURCE_SEARCH_TEXT_ONLY;
+	if (!text_search)
+		text_search = text_search_new(string_find,
+			(match_case ? TEXT_SEARCH_MATCH_CASE : 0)
+			| (use_regex ? TEXT_SEARCH_REGEX : 0), error);
 	
-	if (!string_find)
-		return FALSE;
+	return text_search;
+}
+
+static void set_match_count_note(gint count)
+{
+	gchar *note;
 	
-	if (!match_case)
-		search_flags = search_flags | GTK_SOURCE_SEARCH_CASE_INSENSITIVE;
+	note = g_strdup_printf(_("%d matches"), count);
+	set_main_window_title_note(note);
+	g_free(note);
+}
+
+static void cb_match_index_done(MatchIndex *mi)
+{
+	set_match_count_note(match_index_get_count(mi));
+}
+
+/* and so does the index of its matches, which follows the edits */
+static MatchIndex *get_match_index(GtkTextBuffer *buffer)
+{
+	if (!match_index)
+		match_index = match_index_new(buffer, get_text_search(NULL),
+			(MatchIndexFunc)cb_match_index_done, NULL);
 	
-	gtk_text_buffer_get_bounds(buffer, &start, &end);
-/*	gtk_text_buffer_remove_tag_by_name(buffer,
-		"searched", &start, &end);
-	gtk_text_buffer_remove_tag_by_name(buffer,
-		"replaced", &start, &end);	*/
-	gtk_text_buffer_remove_all_tags(buffer, &start, &end);
-	iter = start;
-	do {
-		res = gtk_source_iter_forward_search(
-			&iter, str, search_flags, &start, &end, NULL);
-		if (res) {
-			retval = TRUE;
-			gtk_text_buffer_apply_tag_by_name(buffer,
-				"searched", &start, &end);
-//				replace_mode ? "replaced" : "searched", &start, &end);
-			iter = end;
+	return match_index;
+}
+
+static void reset_text_search(void)
+{
+	needle_changed = TRUE;
+	match_index_free(match_index);
+	match_index = NULL;
+	text_search_unref(text_search);
+	text_search = NULL;
+}
+
+/* pinned down by marks when the dialog is accepted, so it follows edits */
+static void set_search_scope(GtkWidget *textview)
+{
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
+	GtkTextIter start, end;
+	GdkRectangle rect;
+	
+	/* the highlights and the index are for the old scope */
+	if (scope_start || search_scope != SCOPE_DOCUMENT)
+		reset_text_search();
+	if (scope_start) {
+		gtk_text_buffer_delete_mark(buffer, scope_start);
+		gtk_text_buffer_delete_mark(buffer, scope_end);
+		scope_start = scope_end = NULL;
+	}
+	
+	switch (search_scope) {
+	case SCOPE_SELECTION:
+	case SCOPE_LINES:
+		if (!gtk_text_buffer_get_selection_bounds(buffer, &start, &end))
+			return;
+		if (search_scope == SCOPE_LINES) {
+			gtk_text_iter_set_line_offset(&start, 0);
+			if (!gtk_text_iter_starts_line(&end))
+				gtk_text_iter_forward_line(&end);
 		}
-	} while (res);
+		break;
+	case SCOPE_VISIBLE:
+		gtk_text_view_get_visible_rect(GTK_TEXT_VIEW(textview), &rect);
+		gtk_text_view_get_line_at_y(GTK_TEXT_VIEW(textview),
+			&start, rect.y, NULL);
+		gtk_text_view_get_line_at_y(GTK_TEXT_VIEW(textview),
+			&end, rect.y + rect.height, NULL);
+		gtk_text_iter_forward_line(&end);
+		break;
+	default:
+		return;
+	}
+	scope_start = gtk_text_buffer_create_mark(buffer, NULL, &start, TRUE);
+	scope_end = gtk_text_buffer_create_mark(buffer, NULL, &end, FALSE);
+}
+
+/* the whole buffer when there is no scope, or it has been emptied */
+static gboolean get_search_scope(GtkTextBuffer *buffer,
+	GtkTextIter *start, GtkTextIter *end)
+{
+	if (scope_start) {
+		gtk_text_buffer_get_iter_at_mark(buffer, start, scope_start);
+		gtk_text_buffer_get_iter_at_mark(buffer, end, scope_end);
+		if (!gtk_text_iter_equal(start, end))
+			return TRUE;
+	}
+	gtk_text_buffer_get_bounds(buffer, start, end);
+	
+	return FALSE;
+}
+
+static gboolean hlight_searched_strings(GtkWidget *textview)
+{
+	GtkTextIter start, end;
+	gboolean retval, scoped;
+	
+	if (!string_find || !get_text_search(NULL))
+		return FALSE;
+	
+	/* only the visible part is tagged before this returns; the matches
+	   are counted by the tagging when there is no index to do it */
+	scoped = get_search_scope(GTK_TEXT_VIEW(textview)->buffer, &start, &end);
+	retval = hlight_searched_start(GTK_TEXT_VIEW(textview),
+		get_text_search(NULL), &start, &end,
+		use_regex || scoped ? set_match_count_note : NULL) > 0;
+	needle_changed = FALSE;
 /*	if (replace_mode)
 		replace_mode = FALSE;
 	else	*/
-	hlight_toggle_searched(buffer);
+	hlight_toggle_searched(GTK_TEXT_VIEW(textview)->buffer);
 	
 	return retval;
 }
 
+/* picks the next match out of a complete index, wrapping around */
+static gboolean search_match_index(GtkTextBuffer *buffer, MatchIndex *mi,
+	gint direction, GtkTextIter *match_start, GtkTextIter *match_end)
+{
+	GtkTextIter iter, bound;
+	gint count = match_index_get_count(mi);
+	gint len = text_search_get_length(get_text_search(NULL));
+	gint n;
+	gchar *note;
+	
+	if (!count)
+		return FALSE;
+	
+	if (direction < 0) {
+		/* the last one ending before the selection */
+		gtk_text_buffer_get_selection_bounds(buffer, &iter, &bound);
+		n = match_index_find(mi, gtk_text_iter_get_offset(&iter) - len + 1) - 1;
+		if (n < 0)
+			n = count - 1;
+	} else {
+		gtk_text_buffer_get_iter_at_mark(buffer, &iter, gtk_text_buffer_get_insert(buffer));
+		n = match_index_find(mi, gtk_text_iter_get_offset(&iter));
+		if (n == count)
+			n = 0;
+	}
+	gtk_text_buffer_get_iter_at_offset(buffer, match_start,
+		match_index_nth(mi, n));
+	*match_end = *match_start;
+	gtk_text_iter_forward_chars(match_end, len);
+	
+	note = g_strdup_printf(_("Match %d of %d"), n + 1, count);
+	set_main_window_title_note(note);
+	g_free(note);
+	
+	return TRUE;
+}
+
 gboolean document_search_real(GtkWidget *textview, gint direction)
 {
-	GtkTextIter iter, match_start, match_end;
-	gboolean res;
-	GtkSourceSearchFlags search_flags = GTK_SOURCE_SEARCH_VISIBLE_ONLY | GTK_SOURCE_SEARCH_TEXT_ONLY;
+	GtkTextIter iter, match_start, match_end, start, end;
+	gboolean res, scoped;
 	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
+	MatchIndex *mi;
 	
-	if (!string_find)
+	if (!string_find || !get_text_search(NULL))
 		return FALSE;
 	
-	if (!match_case)
-		search_flags = search_flags | GTK_SOURCE_SEARCH_CASE_INSENSITIVE;
-	
 //	if (direction == 0 || !hlight_check_searched())
-	if (direction == 0 || (direction != 2 && !hlight_check_searched()))
-		hlight_searched_strings(GTK_TEXT_VIEW(textview)->buffer, string_find);
+	/* the highlights stay good while the needle is the same one */
+	if ((direction == 0 && needle_changed)
+		|| (direction != 2 && !hlight_check_searched())) {
+		/* retagging a new needle keeps the highlights switched on */
+		if (hlight_check_searched())
+			hlight_toggle_searched(textbuffer);
+		hlight_searched_strings(textview);
+	}
 	
 	gtk_text_mark_set_visible(
 		gtk_text_buffer_get_selection_bound(
 			GTK_TEXT_VIEW(textview)->buffer), FALSE);
 	
-	gtk_text_buffer_get_iter_at_mark(textbuffer, &iter, gtk_text_buffer_get_insert(textbuffer));
-	if (direction < 0) {
-		res = gtk_source_iter_backward_search(
-			&iter, string_find, search_flags, &match_start, &match_end, NULL);
-		if (gtk_text_iter_equal(&iter, &match_end)) {
-			res = gtk_source_iter_backward_search(
-				&match_start, string_find, search_flags, &match_start, &match_end, NULL);
-		}
+	/* a pattern's matches vary in length, so they are not indexed */
+	scoped = get_search_scope(textbuffer, &start, &end);
+	mi = use_regex || scoped ? NULL : get_match_index(textbuffer);
+	if (mi && match_index_is_complete(mi))
+		res = search_match_index(textbuffer, mi, direction,
+			&match_start, &match_end);
+	else if (direction < 0) {
+		/* start before the selection, which may be the last match */
+		gtk_text_buffer_get_selection_bounds(textbuffer, &iter, &match_end);
+		if (gtk_text_iter_compare(&iter, &end) > 0)
+			iter = end;
+		res = text_search_backward(
+			get_text_search(NULL), &iter, &match_start, &match_end, &start);
 	} else {
-		res = gtk_source_iter_forward_search(
-			&iter, string_find, search_flags, &match_start, &match_end, NULL);
+		gtk_text_buffer_get_iter_at_mark(textbuffer, &iter, gtk_text_buffer_get_insert(textbuffer));
+		if (gtk_text_iter_compare(&iter, &start) < 0)
+			iter = start;
+		res = text_search_forward(
+			get_text_search(NULL), &iter, &match_start, &match_end, &end);
 	}
-	/* TODO: both gtk_(text/source)_iter_backward_search works not fine for multi-byte */
-	
-	/* wrap */
-	/* TODO: define limit NULL -> proper value */
-	if (!res) {
-		if (direction < 0) {
-			gtk_text_buffer_get_end_iter(textbuffer, &iter);
-			res = gtk_source_iter_backward_search(
-				&iter, string_find, search_flags, &match_start, &match_end, NULL);
-		} else {
-			gtk_text_buffer_get_start_iter(textbuffer, &iter);
-			res = gtk_source_iter_forward_search(
-				&iter, string_find, search_flags, &match_start, &match_end, NULL);
-		}
+	
+	/* wrap, within the scope */
+	if (!res && !(mi && match_index_is_complete(mi))) {
+		if (direction < 0)
+			res = text_search_backward(
+				get_text_search(NULL), &end, &match_start, &match_end, &start);
+		else
+			res = text_search_forward(
+				get_text_search(NULL), &start, &match_start, &match_end, &end);
 	}
 	
 	if (res) {
@@ -142,75 +293,176 @@ gboolean document_search_real(GtkWidget *textview, gint direction)
 	return res;
 }
 
+typedef struct {
+	gint start, end;	/* of the match, in chars */
+	gchar *str;
+	glong len;	/* of str, in chars */
+} ReplaceEdit;
+
+typedef struct {
+	GArray *edits;
+	glong delta;
+	gint cursor, new_cursor;
+} ReplaceAll;
+
+static void cb_replace_all(GtkTextIter *match_start, GtkTextIter *match_end,
+	ReplaceAll *ra)
+{
+	ReplaceEdit edit;
+	
+	edit.start = gtk_text_iter_get_offset(match_start);
+	edit.end = gtk_text_iter_get_offset(match_end);
+	if (ra->new_cursor < 0 && edit.end > ra->cursor)
+		ra->new_cursor = MIN(ra->cursor, edit.start) + ra->delta;
+	
+	edit.str = text_search_expand(get_text_search(NULL),
+		match_start, match_end, string_replace);
+	edit.len = g_utf8_strlen(edit.str, -1);
+	g_array_append_val(ra->edits, edit);
+	ra->delta += edit.len - (edit.end - edit.start);
+}
+
+/*
+ * Finds every match in one pass, then puts the span from the first match
+ * to the end of the last back as one rewritten text, which the undo history
+ * keeps as a single step of two entries, however many matches there are.
+ */
+static gint document_replace_all(GtkWidget *textview)
+{
+	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
+	GtkTextIter start, end, iter;
+	ReplaceAll ra = { NULL };
+	ReplaceEdit *edit;
+	GString *gstr;
+	gchar *text;
+	const gchar *p, *q;
+	glong delta, pos;
+	guint i;
+	gint count;
+	
+	hlight_searched_cancel();
+	/* rebuilt afterwards, rather than patched for the replacement */
+	match_index_free(match_index);
+	match_index = NULL;
+	
+	gtk_text_buffer_get_bounds(textbuffer, &start, &end);
+//	gtk_text_buffer_remove_tag_by_name(textbuffer,
+//		"replaced", &start, &end);
+	gtk_text_buffer_remove_all_tags(textbuffer, &start, &end);
+	get_search_scope(textbuffer, &start, &end);
+	
+	gtk_text_buffer_get_iter_at_mark(textbuffer,
+		&iter, gtk_text_buffer_get_insert(textbuffer));
+	ra.cursor = gtk_text_iter_get_offset(&iter);
+	ra.new_cursor = -1;
+	ra.edits = g_array_new(FALSE, FALSE, sizeof(ReplaceEdit));
+	text_search_foreach(get_text_search(NULL), &start, &end,
+		(TextSearchFunc)cb_replace_all, &ra, NULL);
+	count = ra.edits->len;
+	
+	if (count) {
+		edit = &g_array_index(ra.edits, ReplaceEdit, 0);
+		gtk_text_buffer_get_iter_at_offset(textbuffer, &start, edit->start);
+		gtk_text_buffer_get_iter_at_offset(textbuffer, &end,
+			g_array_index(ra.edits, ReplaceEdit, count - 1).end);
+		text = gtk_text_iter_get_slice(&start, &end);
+		gstr = g_string_sized_new(strlen(text));
+		p = text;
+		pos = edit->start;
+		for (i = 0; i < ra.edits->len; i++) {
+			edit = &g_array_index(ra.edits, ReplaceEdit, i);
+			q = g_utf8_offset_to_pointer(p, edit->start - pos);
+			g_string_append_len(gstr, p, q - p);
+			g_string_append(gstr, edit->str);
+			p = g_utf8_offset_to_pointer(q, edit->end - edit->start);
+			pos = edit->end;
+		}
+		g_free(text);
+		
+		undo_set_sequency(FALSE);
+		g_signal_emit_by_name(G_OBJECT(textbuffer), "begin-user-action");
+		undo_set_sequency_reserve();
+		gtk_text_buffer_delete(textbuffer, &start, &end);
+		if (gstr->len)
+			gtk_text_buffer_insert(textbuffer, &start, gstr->str, gstr->len);
+		g_signal_emit_by_name(G_OBJECT(textbuffer), "end-user-action");
+		undo_set_sequency(FALSE);
+		g_string_free(gstr, TRUE);
+		
+		/* one walk over the new text, instead of a lookup per tag */
+		edit = &g_array_index(ra.edits, ReplaceEdit, 0);
+		gtk_text_buffer_get_iter_at_offset(textbuffer, &end, edit->start);
+		pos = edit->start;
+		delta = 0;
+		for (i = 0; i < ra.edits->len; i++) {
+			edit = &g_array_index(ra.edits, ReplaceEdit, i);
+			start = end;
+			gtk_text_iter_forward_chars(&start, edit->start + delta - pos);
+			end = start;
+			gtk_text_iter_forward_chars(&end, edit->len);
+			gtk_text_buffer_apply_tag_by_name(textbuffer,
+				"replaced", &start, &end);
+			delta += edit->len - (edit->end - edit->start);
+			pos = edit->end + delta;
+		}
+	}
+	for (i = 0; i < ra.edits->len; i++)
+		g_free(g_array_index(ra.edits, ReplaceEdit, i).str);
+	g_array_free(ra.edits, TRUE);
+	
+	gtk_text_buffer_get_iter_at_offset(textbuffer, &iter,
+		ra.new_cursor < 0 ? ra.cursor + ra.delta : ra.new_cursor);
+	gtk_text_buffer_place_cursor(textbuffer, &iter);
+	if (!hlight_check_searched())
+		hlight_toggle_searched(textbuffer);
+	run_dialog_message(gtk_widget_get_toplevel(textview), GTK_MESSAGE_INFO,
+		_("%d strings replaced"), count);
+	
+	return count;
+}
+
 static gint document_replace_real(GtkWidget *textview)
 {
 	GtkTextIter iter, match_start, match_end, rep_start;
-	GtkTextMark *mark_init = NULL;
 	gboolean res;
 	gint num = 0, offset;
 	GtkWidget *q_dialog = NULL;
-	GtkSourceSearchFlags search_flags = GTK_SOURCE_SEARCH_VISIBLE_ONLY | GTK_SOURCE_SEARCH_TEXT_ONLY;	
 	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
 	gboolean did_replace = FALSE;
+	gchar *replacement;
 	
-	if (!match_case)
-		search_flags = search_flags | GTK_SOURCE_SEARCH_CASE_INSENSITIVE;
+	if (replace_all)
+		return document_replace_all(textview);
 	
-	if (replace_all) {
-		gtk_text_buffer_get_iter_at_mark(textbuffer,
-			&iter, gtk_text_buffer_get_insert(textbuffer));
-		mark_init = gtk_text_buffer_create_mark(textbuffer, NULL, &iter, FALSE);
-		gtk_text_buffer_get_start_iter(textbuffer, &iter);
-		
-		gtk_text_buffer_get_end_iter(textbuffer, &match_end);
-//		gtk_text_buffer_remove_tag_by_name(textbuffer,
-//			"replaced", &iter, &match_end);
-		gtk_text_buffer_remove_all_tags(textbuffer,
-			&iter, &match_end);
-	} else {
-		hlight_searched_strings(textbuffer, string_find);
-		hlight_toggle_searched(textbuffer);
-	}
+	hlight_searched_strings(textview);
+	hlight_toggle_searched(textbuffer);
 	
 	do {
-		if (replace_all) {
-			res = gtk_source_iter_forward_search(
-				&iter, string_find, search_flags, &match_start, &match_end, NULL);
-			if (res) {
-				gtk_text_buffer_place_cursor(textbuffer, &match_start);
-				gtk_text_buffer_move_mark_by_name(textbuffer, "insert", &match_end);
-				gtk_text_buffer_get_iter_at_mark(
-					textbuffer, &iter, gtk_text_buffer_get_insert(textbuffer));
-			}
-		}
-		else
-//			res = document_search_real(textview, 0);
-			res = document_search_real(textview, 2);
+//		res = document_search_real(textview, 0);
+		res = document_search_real(textview, 2);
 		
 		if (res) {
-			if (!replace_all) {
-				if (num == 0 && q_dialog == NULL)
-					q_dialog = create_dialog_message_question(
-						gtk_widget_get_toplevel(textview), _("Replace?"));
+			if (num == 0 && q_dialog == NULL)
+				q_dialog = create_dialog_message_question(
+					gtk_widget_get_toplevel(textview), _("Replace?"));
 #if GTK_CHECK_VERSION(2, 10, 0)
-					GtkTextIter ins,bou;
-					gtk_text_buffer_get_selection_bounds(textbuffer, &ins, &bou);
+				GtkTextIter ins,bou;
+				gtk_text_buffer_get_selection_bounds(textbuffer, &ins, &bou);
 #endif
-				switch (gtk_dialog_run(GTK_DIALOG(q_dialog))) {
-				case GTK_RESPONSE_YES:
+			switch (gtk_dialog_run(GTK_DIALOG(q_dialog))) {
+			case GTK_RESPONSE_YES:
 #if GTK_CHECK_VERSION(2, 10, 0)
-					gtk_text_buffer_select_range(textbuffer, &ins, &bou);
+				gtk_text_buffer_select_range(textbuffer, &ins, &bou);
 #endif
-					break;
-				case GTK_RESPONSE_NO:
-					continue;
-//				case GTK_RESPONSE_CANCEL:
-				default:
-					res = 0;
-					if (num == 0)
-						num = -1;
-					continue;
-				}
+				break;
+			case GTK_RESPONSE_NO:
+				continue;
+//			case GTK_RESPONSE_CANCEL:
+			default:
+				res = 0;
+				if (num == 0)
+					num = -1;
+				continue;
 			}
 			
 			if (!did_replace) {
@@ -218,8 +470,12 @@ static gint document_replace_real(GtkWidget *textview)
 				did_replace = TRUE;
 			}
 			
+			gtk_text_buffer_get_selection_bounds(textbuffer,
+				&match_start, &match_end);
+			replacement = text_search_expand(get_text_search(NULL),
+				&match_start, &match_end, string_replace);
 			gtk_text_buffer_delete_selection(textbuffer, TRUE, TRUE);
-			if (strlen(string_replace)) {
+			if (strlen(replacement)) {
 				gtk_text_buffer_get_iter_at_mark(
 					textbuffer, &rep_start,
 					gtk_text_buffer_get_insert(textbuffer));
@@ -228,7 +484,7 @@ static gint document_replace_real(GtkWidget *textview)
 				g_signal_emit_by_name(G_OBJECT(textbuffer),
 					"begin-user-action");
 				gtk_text_buffer_insert_at_cursor(textbuffer,
-					string_replace, strlen(string_replace));
+					replacement, strlen(replacement));
 				g_signal_emit_by_name(G_OBJECT(textbuffer),
 					"end-user-action");
 				gtk_text_buffer_get_iter_at_mark(
@@ -242,13 +498,10 @@ static gint document_replace_real(GtkWidget *textview)
 				gtk_text_buffer_get_iter_at_mark(
 					textbuffer, &iter,
 					gtk_text_buffer_get_insert(textbuffer));
+			g_free(replacement);
 			
 			num++;
-/*			if (replace_all)
-				undo_set_sequency(TRUE);
-			else
-				undo_set_sequency(FALSE);*/
-			undo_set_sequency(replace_all);
+			undo_set_sequency(FALSE);
 		}
 	} while (res);
 	if (!hlight_check_searched())
@@ -260,14 +513,6 @@ static gint document_replace_real(GtkWidget *textview)
 		replace_mode = TRUE;
 		hlight_searched_strings(textbuffer, string_replace);
 	}	*/
-	if (replace_all) {
-		gtk_text_buffer_get_iter_at_mark(textbuffer, &iter, mark_init);
-		gtk_text_buffer_place_cursor(textbuffer, &iter);
-		run_dialog_message(gtk_widget_get_toplevel(textview), GTK_MESSAGE_INFO,
-			_("%d strings replaced"), num);
-		undo_set_sequency(FALSE);
-	}
-	
 	return num;
 }
 
@@ -293,20 +538,61 @@ static void toggle_sensitivity(GtkWidget *w, gint pos1, gint pos2, gint *pos3)
 static void toggle_check_case(GtkWidget *widget)
 {
 	match_case = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	reset_text_search();
 }
 
+#ifdef ENABLE_REGEX
+static void toggle_check_regex(GtkWidget *widget)
+{
+	use_regex = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	reset_text_search();
+}
+#endif
+
 static void toggle_check_all(GtkWidget *widget)
 {
 	replace_all = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
 }
 
+static void cb_select_scope(GtkOptionMenu *option_menu)
+{
+	search_scope = gtk_option_menu_get_history(option_menu);
+}
+
+static GtkWidget *create_scope_menu(void)
+{
+	GtkWidget *option_menu;
+	GtkWidget *menu;
+	GtkWidget *menu_item;
+	gint i;
+	
+	option_menu = gtk_option_menu_new();
+	menu = gtk_menu_new();
+	for (i = 0; i < G_N_ELEMENTS(scope_str); i++) {
+		menu_item = gtk_menu_item_new_with_label(_(scope_str[i]));
+		gtk_menu_shell_append(GTK_MENU_SHELL(menu), menu_item);
+		gtk_widget_show(menu_item); // <- required for width adjustment
+	}
+	gtk_option_menu_set_menu(GTK_OPTION_MENU(option_menu), menu);
+	gtk_option_menu_set_history(GTK_OPTION_MENU(option_menu), search_scope);
+	g_signal_connect(G_OBJECT(option_menu), "changed",
+		G_CALLBACK(cb_select_scope), NULL);
+	
+	return option_menu;
+}
+
 gint run_dialog_search(GtkWidget *textview, gint mode)
 {
 	GtkWidget *dialog;
 	GtkWidget *table;
-	GtkWidget *label_find, *label_replace;
+	GtkWidget *label_find, *label_replace, *label_scope;
+	GtkWidget *option_scope;
 	GtkWidget *entry_find, *entry_replace = NULL;
 	GtkWidget *check_case, *check_all;
+#ifdef ENABLE_REGEX
+	GtkWidget *check_regex;
+#endif
+	GError *err = NULL;
 	gint res;
 	
 	if (mode)
@@ -325,7 +611,7 @@ gint run_dialog_search(GtkWidget *textview, gint mode)
 			NULL);
 	gtk_dialog_set_has_separator(GTK_DIALOG(dialog), FALSE);
 	
-	table = gtk_table_new(mode + 2, 2, FALSE);
+	table = gtk_table_new(mode * 2 + 4, 2, FALSE);
 	 gtk_table_set_row_spacings(GTK_TABLE(table), 8);
 	 gtk_table_set_col_spacings(GTK_TABLE(table), 8);
 	 gtk_container_set_border_width(GTK_CONTAINER(table), 8);
@@ -363,33 +649,55 @@ gint run_dialog_search(GtkWidget *textview, gint mode)
 	if (mode)
 		gtk_entry_set_activates_default(GTK_ENTRY(entry_replace), TRUE);
 	
+	label_scope = gtk_label_new_with_mnemonic(_("_Search in:"));
+	 gtk_misc_set_alignment(GTK_MISC(label_scope), 0, 0.5);
+	 gtk_table_attach_defaults(GTK_TABLE(table), label_scope, 0, 1, 1 + mode, 2 + mode);
+	option_scope = create_scope_menu();
+	 gtk_table_attach_defaults(GTK_TABLE(table), option_scope, 1, 2, 1 + mode, 2 + mode);
+	 gtk_label_set_mnemonic_widget(GTK_LABEL(label_scope), option_scope);
+	
 	check_case = gtk_check_button_new_with_mnemonic(_("_Match case"));
 	 gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check_case), match_case);
 	 g_signal_connect(GTK_OBJECT(check_case), "toggled", G_CALLBACK(toggle_check_case), NULL);
-	 gtk_table_attach_defaults (GTK_TABLE(table), check_case, 0, 2, 1 + mode, 2 + mode);
+	 gtk_table_attach_defaults (GTK_TABLE(table), check_case, 0, 2, 2 + mode, 3 + mode);
+#ifdef ENABLE_REGEX
+	check_regex = gtk_check_button_new_with_mnemonic(_("Regular e_xpression"));
+	 gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check_regex), use_regex);
+	 g_signal_connect(GTK_OBJECT(check_regex), "toggled", G_CALLBACK(toggle_check_regex), NULL);
+	 gtk_table_attach_defaults(GTK_TABLE(table), check_regex, 0, 2, 3 + mode, 4 + mode);
+#endif
 	if (mode) {
 	check_all = gtk_check_button_new_with_mnemonic(_("Replace _all at once"));
 	 gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check_all), replace_all);
 	 g_signal_connect(GTK_OBJECT(check_all), "toggled", G_CALLBACK(toggle_check_all), NULL);
-	 gtk_table_attach_defaults(GTK_TABLE(table), check_all, 0, 2, 2 + mode, 3 + mode);
+	 gtk_table_attach_defaults(GTK_TABLE(table), check_all, 0, 2, 4 + mode, 5 + mode);
 	}
 	gtk_window_set_resizable(GTK_WINDOW(dialog), FALSE);
 	gtk_widget_show_all(table);	
 	
 	res = gtk_dialog_run(GTK_DIALOG(dialog));
 	if (res == GTK_RESPONSE_OK) {
-		g_free(string_find);
-		string_find = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_find)));
+		if (!string_find
+			|| strcmp(string_find, gtk_entry_get_text(GTK_ENTRY(entry_find)))) {
+			g_free(string_find);
+			string_find = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_find)));
+			reset_text_search();
+		}
 		if (mode) {
 			g_free(string_replace);
 			string_replace = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry_replace)));
 		}
+		set_search_scope(textview);
 	}
 	
 	gtk_widget_destroy(dialog);
 	
 	if (res == GTK_RESPONSE_OK) {
-		if (strlen(string_find)) {
+		if (strlen(string_find) && !get_text_search(&err)) {
+			run_dialog_message(gtk_widget_get_toplevel(textview),
+				GTK_MESSAGE_WARNING, "%s", err->message);
+			g_error_free(err);
+		} else if (strlen(string_find)) {
 			if (mode)
 				document_replace_real(textview);
 			else
@@ -0,0 +1,817 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Searches the buffer a large slice at a time instead of line by line, so
+ * that the haystack is never copied or case-folded more than once. The
+ * needle is prepared up front, and iterators are only made for the hit.
+ */
+
+#include <string.h>
+#include <gtk/gtk.h>
+#include "textsearch.h"
+
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
+#define TEXT_SEARCH_SEGMENT (1 << 20)	/* chars sliced out at once */
+#define TEXT_SEARCH_FIRST_SEGMENT 4096	/* for a hit close by, grows from here */
+
+#ifdef ENABLE_REGEX
+#	if GLIB_CHECK_VERSION(2, 34, 0)
+#		define TEXT_SEARCH_PARTIAL G_REGEX_MATCH_PARTIAL_HARD
+#	else
+#		define TEXT_SEARCH_PARTIAL 0	/* so no slicing */
+#	endif
+#endif
+
+struct _TextSearch {
+	gint ref;
+#ifdef ENABLE_REGEX
+	GRegex *regex;	/* in place of all the rest */
+	GMatchInfo *match;	/* the one a foreach func is called on */
+#endif
+	guchar *needle;	/* lowered when the case is ignored */
+	gsize len;
+	glong chars;
+	gunichar *folded;	/* for a non-ASCII needle without case */
+	guchar fold[256];
+	gsize skip[256];
+	gsize rskip[256];	/* the same, for scanning backward */
+	guchar first_mask;	/* 0x20 where an ASCII letter may be upper case */
+	guchar last_mask;
+};
+
+/* simple per-character folding, so that a match is as long as the needle */
+static gunichar text_search_fold_char(TextSearch *ts, const gchar *p)
+{
+	if (!(*p & 0x80))
+		return ts->fold[(guchar)*p];
+	
+	return g_unichar_tolower(g_unichar_toupper(g_utf8_get_char(p)));
+}
+
+/* error is only set for a pattern that does not compile */
+TextSearch *text_search_new(const gchar *str, TextSearchFlags flags,
+	GError **error)
+{
+	TextSearch *ts;
+	const gchar *p;
+	gsize i;
+	glong n;
+	gboolean match_case = (flags & TEXT_SEARCH_MATCH_CASE) != 0;
+	
+	ts = g_new0(TextSearch, 1);
+	ts->ref = 1;
+#ifdef ENABLE_REGEX
+	if (flags & TEXT_SEARCH_REGEX) {
+		/* ^ and $ are per line; \n has to be spelled out to cross one */
+		ts->regex = g_regex_new(str, G_REGEX_MULTILINE | G_REGEX_OPTIMIZE
+			| (match_case ? 0 : G_REGEX_CASELESS), 0, error);
+		if (!ts->regex) {
+			g_free(ts);
+			return NULL;
+		}
+		ts->chars = 1;	/* never empty */
+		return ts;
+	}
+#endif
+	ts->len = strlen(str);
+	ts->chars = g_utf8_strlen(str, -1);
+	for (i = 0; i < 256; i++)
+		ts->fold[i] = match_case ? i : g_ascii_tolower(i);
+	
+	for (p = str; *p && !(*p & 0x80); p++)
+		;
+	if (!match_case && *p) {
+		ts->folded = g_new(gunichar, ts->chars);
+		for (p = str, n = 0; *p; p = g_utf8_next_char(p), n++)
+			ts->folded[n] = text_search_fold_char(ts, p);
+		return ts;
+	}
+	
+	/* Horspool's shift table over the (folded) bytes */
+	ts->needle = (guchar *)g_strdup(str);
+	for (i = 0; i < ts->len; i++)
+		ts->needle[i] = ts->fold[ts->needle[i]];
+	for (i = 0; i < 256; i++)
+		ts->skip[i] = ts->len;
+	for (i = 0; i + 1 < ts->len; i++)
+		ts->skip[ts->needle[i]] = ts->len - 1 - i;
+	for (i = 0; i < 256; i++)
+		ts->rskip[i] = ts->len;
+	for (i = ts->len - 1; i > 0; i--)
+		ts->rskip[ts->needle[i]] = i;
+	if (!match_case) {
+		if (g_ascii_isalpha(ts->needle[0]))
+			ts->first_mask = 0x20;
+		if (g_ascii_isalpha(ts->needle[ts->len - 1]))
+			ts->last_mask = 0x20;
+	}
+	
+	return ts;
+}
+
+TextSearch *text_search_ref(TextSearch *ts)
+{
+	ts->ref++;
+	
+	return ts;
+}
+
+void text_search_unref(TextSearch *ts)
+{
+	if (ts && !--ts->ref) {
+#ifdef ENABLE_REGEX
+		if (ts->regex)
+			g_regex_unref(ts->regex);
+#endif
+		g_free(ts->needle);
+		g_free(ts->folded);
+		g_free(ts);
+	}
+}
+
+/* UTF-8 synchronizes itself, so a byte match is always a character match */
+static const gchar *text_search_scan_bytes(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const guchar *s = (const guchar *)text, *end = (const guchar *)text_end;
+	gsize last = ts->len - 1, i;
+	guchar c;
+	
+	while ((gsize)(end - s) > last) {
+		c = ts->fold[s[last]];
+		if (c == ts->needle[last]) {
+			for (i = 0; i < last && ts->fold[s[i]] == ts->needle[i]; i++)
+				;
+			if (i == last) {
+				*match_end = (const gchar *)s + ts->len;
+				return (const gchar *)s;
+			}
+		}
+		s += ts->skip[c];
+	}
+	
+	return NULL;
+}
+
+static const gchar *text_search_rscan_bytes(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const guchar *base = (const guchar *)text;
+	gssize pos = (text_end - text) - (gssize)ts->len;
+	gsize i;
+	guchar c;
+	
+	while (pos >= 0) {
+		c = ts->fold[base[pos]];
+		if (c == ts->needle[0]) {
+			for (i = 1; i < ts->len && ts->fold[base[pos + i]] == ts->needle[i]; i++)
+				;
+			if (i == ts->len) {
+				*match_end = text + pos + ts->len;
+				return text + pos;
+			}
+		}
+		pos -= ts->rskip[c];
+	}
+	
+	return NULL;
+}
+
+#ifdef __SSE2__
+/*
+ * Tests 16 positions at a time on the needle's first and last bytes, and
+ * only compares the rest where both agree. Setting 0x20 folds an ASCII
+ * letter to lower case; other bytes that it sends to the same value are
+ * weeded out by the full comparison.
+ */
+static guint text_search_candidates(TextSearch *ts, const guchar *s)
+{
+	__m128i a, b;
+	
+	a = _mm_or_si128(_mm_loadu_si128((const __m128i *)s),
+		_mm_set1_epi8(ts->first_mask));
+	b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + ts->len - 1)),
+		_mm_set1_epi8(ts->last_mask));
+	
+	return _mm_movemask_epi8(_mm_and_si128(
+		_mm_cmpeq_epi8(a, _mm_set1_epi8(ts->needle[0])),
+		_mm_cmpeq_epi8(b, _mm_set1_epi8(ts->needle[ts->len - 1]))));
+}
+
+static gboolean text_search_equal(TextSearch *ts, const guchar *s)
+{
+	gsize i;
+	
+	for (i = 0; i < ts->len && ts->fold[s[i]] == ts->needle[i]; i++)
+		;
+	
+	return i == ts->len;
+}
+
+static const gchar *text_search_scan_sse2(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const guchar *s = (const guchar *)text, *end = (const guchar *)text_end;
+	guint bits;
+	gint j;
+	
+	while ((gsize)(end - s) >= ts->len + 15) {
+		bits = text_search_candidates(ts, s);
+		for (j = -1; (j = g_bit_nth_lsf(bits, j)) >= 0; )
+			if (text_search_equal(ts, s + j)) {
+				*match_end = (const gchar *)s + j + ts->len;
+				return (const gchar *)s + j;
+			}
+		s += 16;
+	}
+	
+	return text_search_scan_bytes(ts, (const gchar *)s, text_end, match_end);
+}
+
+static const gchar *text_search_rscan_sse2(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const guchar *base = (const guchar *)text;
+	gssize pos = (text_end - text) - (gssize)ts->len - 15;
+	guint bits;
+	gint j;
+	
+	/* blocks of 16 starting points, last block first */
+	for (; pos >= 0; pos -= 16) {
+		bits = text_search_candidates(ts, base + pos);
+		for (j = -1; (j = g_bit_nth_msf(bits, j)) >= 0; )
+			if (text_search_equal(ts, base + pos + j)) {
+				*match_end = text + pos + j + ts->len;
+				return text + pos + j;
+			}
+	}
+	if (pos + 16 <= 0)
+		return NULL;
+	
+	return text_search_rscan_bytes(ts,
+		text, text + pos + 15 + ts->len, match_end);
+}
+#endif
+
+/* steps over plain ASCII, which cannot begin a match for a non-ASCII char */
+static const gchar *text_search_skip_ascii(const gchar *p, const gchar *end)
+{
+#ifdef __SSE2__
+	while (end - p >= 16
+		&& !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)))
+		p += 16;
+#endif
+	while (p < end && !(*p & 0x80))
+		p++;
+	
+	return p;
+}
+
+/* the same backward; returns the start of the ASCII run ending at p */
+static const gchar *text_search_rskip_ascii(const gchar *text, const gchar *p)
+{
+#ifdef __SSE2__
+	while (p - text >= 16
+		&& !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p - 16))))
+		p -= 16;
+#endif
+	while (p > text && !(p[-1] & 0x80))
+		p--;
+	
+	return p;
+}
+
+/* the end of a match starting at p, or NULL */
+static const gchar *text_search_match_chars(TextSearch *ts,
+	const gchar *p, const gchar *text_end)
+{
+	glong i;
+	
+	for (i = 0; i < ts->chars && p < text_end; i++) {
+		if (text_search_fold_char(ts, p) != ts->folded[i])
+			return NULL;
+		p = g_utf8_next_char(p);
+	}
+	
+	return i == ts->chars ? p : NULL;
+}
+
+static const gchar *text_search_scan_chars(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const gchar *p;
+	gboolean wide = ts->folded[0] >= 0x80;
+	
+	for (p = text; p < text_end; p = g_utf8_next_char(p)) {
+		if (wide && !(*p & 0x80)) {
+			p = text_search_skip_ascii(p, text_end);
+			if (p == text_end)
+				break;
+		}
+		if ((*match_end = text_search_match_chars(ts, p, text_end)))
+			return p;
+	}
+	
+	return NULL;
+}
+
+/* steps back a char at a time, so multi-byte chars are never split */
+static const gchar *text_search_rscan_chars(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	const gchar *p = text_end;
+	gboolean wide = ts->folded[0] >= 0x80;
+	
+	while (p > text) {
+		p = g_utf8_prev_char(p);
+		if (wide && !(*p & 0x80)) {
+			p = text_search_rskip_ascii(text, p);
+			continue;
+		}
+		if ((*match_end = text_search_match_chars(ts, p, text_end)))
+			return p;
+	}
+	
+	return NULL;
+}
+
+static const gchar *text_search_scan(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	if (ts->folded)
+		return text_search_scan_chars(ts, text, text_end, match_end);
+#ifdef __SSE2__
+	return text_search_scan_sse2(ts, text, text_end, match_end);
+#else
+	return text_search_scan_bytes(ts, text, text_end, match_end);
+#endif
+}
+
+static const gchar *text_search_rscan(TextSearch *ts,
+	const gchar *text, const gchar *text_end, const gchar **match_end)
+{
+	if (ts->folded)
+		return text_search_rscan_chars(ts, text, text_end, match_end);
+#ifdef __SSE2__
+	return text_search_rscan_sse2(ts, text, text_end, match_end);
+#else
+	return text_search_rscan_bytes(ts, text, text_end, match_end);
+#endif
+}
+
+glong text_search_get_length(TextSearch *ts)
+{
+	return ts->chars;
+}
+
+/*
+ * Appends the char offset of every match starting before limit, where text
+ * is a slice beginning at offset. As everywhere else, a match is looked
+ * for from the end of the one before, so none of them overlap.
+ */
+void text_search_scan_offsets(TextSearch *ts, const gchar *text,
+	gint offset, gint limit, GArray *starts)
+{
+	const gchar *text_end = text + strlen(text), *p = text, *q, *prev = text;
+	
+	if (!ts->chars)
+		return;
+	while ((p = text_search_scan(ts, p, text_end, &q))) {
+		offset += g_utf8_strlen(prev, p - prev);
+		if (offset >= limit)
+			break;
+		g_array_append_val(starts, offset);
+		prev = p;
+		p = q;
+	}
+}
+
+/* slices keep pixbufs as U+FFFC, so char offsets map straight back */
+static void text_search_set_match(const GtkTextIter *start, const gchar *text,
+	const gchar *p, const gchar *q, GtkTextIter *match_start, GtkTextIter *match_end)
+{
+	GtkTextIter iter = *start;
+	
+	gtk_text_iter_forward_chars(&iter, g_utf8_strlen(text, p - text));
+	if (match_start)
+		*match_start = iter;
+	if (match_end) {
+		gtk_text_iter_forward_chars(&iter, g_utf8_strlen(p, q - p));
+		*match_end = iter;
+	}
+}
+
+#ifdef ENABLE_REGEX
+/*
+ * A pattern sees whole lines, so that ^, $ and lookarounds near the edges
+ * of a slice behave as they would on the whole buffer.
+ */
+static gchar *text_search_regex_slice(const GtkTextIter *start,
+	const GtkTextIter *end, GtkTextIter *line_start, GtkTextIter *line_end,
+	gint *pos)
+{
+	gchar *text;
+	
+	*line_start = *start;
+	gtk_text_iter_set_line_offset(line_start, 0);
+	*line_end = *end;
+	if (!gtk_text_iter_ends_line(line_end))
+		gtk_text_iter_forward_to_line_end(line_end);
+	text = gtk_text_iter_get_slice(line_start, line_end);
+	*pos = g_utf8_offset_to_pointer(text, gtk_text_iter_get_offset(start)
+		- gtk_text_iter_get_offset(line_start)) - text;
+	
+	return text;
+}
+
+/* grows the slice while a match may run past its end */
+static gboolean text_search_regex_forward(TextSearch *ts,
+	const GtkTextIter *iter, GtkTextIter *match_start, GtkTextIter *match_end,
+	const GtkTextIter *bound)
+{
+	GtkTextIter start, end, line_start, line_end;
+	GMatchInfo *info;
+	gchar *text;
+	gint segment = TEXT_SEARCH_FIRST_SEGMENT, pos, s, e;
+	gboolean last, partial, found;
+	
+	start = *iter;
+	while (TRUE) {
+		end = start;
+		if (TEXT_SEARCH_PARTIAL)
+			gtk_text_iter_forward_chars(&end, segment);
+		if (!TEXT_SEARCH_PARTIAL || gtk_text_iter_compare(&end, bound) > 0)
+			end = *bound;
+		text = text_search_regex_slice(&start, &end, &line_start, &line_end, &pos);
+		last = gtk_text_iter_compare(&line_end, bound) >= 0;
+		g_regex_match_full(ts->regex, text, -1, pos, G_REGEX_MATCH_NOTEMPTY
+			| (last ? 0 : TEXT_SEARCH_PARTIAL), &info, NULL);
+		partial = g_match_info_is_partial_match(info);
+		found = !partial && g_match_info_matches(info);
+		if (found) {
+			g_match_info_fetch_pos(info, 0, &s, &e);
+			text_search_set_match(&line_start, text, text + s, text + e,
+				match_start, match_end);
+			/* the slice is whole lines, so it may end past the bound */
+			found = gtk_text_iter_compare(match_end, bound) <= 0;
+			last = TRUE;
+		}
+		g_match_info_free(info);
+		g_free(text);
+		if (found || last)
+			return found;
+		if (!partial)
+			start = line_end;
+		if (segment < TEXT_SEARCH_SEGMENT)
+			segment *= 2;
+		else if (partial)
+			segment = G_MAXINT;	/* the rest of the buffer, then */
+	}
+}
+
+/*
+ * The last match of each slice, going back a slice at a time. Each slice
+ * runs on over the one before, so that a match starting in it may end in
+ * there; one starting in there was looked for already.
+ */
+static gboolean text_search_regex_backward(TextSearch *ts,
+	const GtkTextIter *iter, GtkTextIter *match_start, GtkTextIter *match_end,
+	const GtkTextIter *bound)
+{
+	GtkTextIter start, end, boundary;
+	GMatchInfo *info;
+	gchar *text;
+	gint segment = TEXT_SEARCH_FIRST_SEGMENT, limit, s = -1, e = -1, ms, me;
+	
+	end = boundary = *iter;
+	while (gtk_text_iter_compare(&boundary, bound) > 0) {
+		start = boundary;
+		gtk_text_iter_backward_chars(&start, segment);
+		if (gtk_text_iter_compare(&start, bound) < 0)
+			start = *bound;
+		gtk_text_iter_set_line_offset(&start, 0);
+		text = gtk_text_iter_get_slice(&start, &end);
+		limit = g_utf8_offset_to_pointer(text, gtk_text_iter_get_offset(&boundary)
+			- gtk_text_iter_get_offset(&start)) - text;
+		g_regex_match_full(ts->regex, text, -1, 0, G_REGEX_MATCH_NOTEMPTY
+			| (gtk_text_iter_ends_line(&end) ? 0 : G_REGEX_MATCH_NOTEOL),
+			&info, NULL);
+		while (g_match_info_matches(info)) {
+			g_match_info_fetch_pos(info, 0, &ms, &me);
+			if (ms >= limit)
+				break;
+			s = ms;
+			e = me;
+			g_match_info_next(info, NULL);
+		}
+		g_match_info_free(info);
+		if (s >= 0)
+			text_search_set_match(&start, text, text + s, text + e,
+				match_start, match_end);
+		g_free(text);
+		if (s >= 0)
+			return gtk_text_iter_compare(match_start, bound) >= 0;
+		end = boundary;
+		boundary = start;
+		if (segment < TEXT_SEARCH_SEGMENT)
+			segment *= 2;
+	}
+	
+	return FALSE;
+}
+
+static gint text_search_regex_foreach(TextSearch *ts, const GtkTextIter *start,
+	const GtkTextIter *end, TextSearchFunc func, gpointer data, GtkTextIter *next)
+{
+	GtkTextIter line_start, line_end, match_start, match_end, resume = *end;
+	GtkTextIter stop = *end;
+	GMatchInfo *info;
+	gchar *text;
+	const gchar *prev;
+	gint pos, s, e, count = 0;
+	
+	/* when more slices follow, some text past end shows a match that runs
+	   over it, to be left for the next one */
+	if (next)
+		gtk_text_iter_forward_chars(&stop, TEXT_SEARCH_FIRST_SEGMENT);
+	text = text_search_regex_slice(start, &stop, &line_start, &line_end, &pos);
+	g_regex_match_full(ts->regex, text, -1, pos, G_REGEX_MATCH_NOTEMPTY,
+		&info, NULL);
+	match_end = line_start;
+	prev = text;
+	while (g_match_info_matches(info)) {
+		g_match_info_fetch_pos(info, 0, &s, &e);
+		match_start = match_end;
+		gtk_text_iter_forward_chars(&match_start,
+			g_utf8_strlen(prev, text + s - prev));
+		match_end = match_start;
+		gtk_text_iter_forward_chars(&match_end, g_utf8_strlen(text + s, e - s));
+		prev = text + e;
+		/* the slice is whole lines; what runs past end is left for next */
+		if (gtk_text_iter_compare(&match_end, end) > 0) {
+			if (gtk_text_iter_compare(&match_start, start) > 0)
+				resume = match_start;
+			break;
+		}
+		ts->match = info;
+		func(&match_start, &match_end, data);
+		ts->match = NULL;
+		count++;
+		g_match_info_next(info, NULL);
+	}
+	g_match_info_free(info);
+	g_free(text);
+	if (next)
+		*next = resume;
+	
+	return count;
+}
+#endif
+
+/*
+ * The replacement for the match at [match_start, match_end), with \0 to
+ * \9 and \g<name> filled in for a pattern. Called from a foreach func, it
+ * expands the match the func is called on without searching again.
+ */
+gchar *text_search_expand(TextSearch *ts, const GtkTextIter *match_start,
+	const GtkTextIter *match_end, const gchar *replacement)
+{
+#ifdef ENABLE_REGEX
+	GtkTextIter line_start, line_end;
+	gchar *text, *str;
+	gint pos;
+	
+	if (ts->match && (str = g_match_info_expand_references(ts->match,
+		replacement, NULL)))
+		return str;
+	if (ts->regex) {
+		text = text_search_regex_slice(match_start, match_end,
+			&line_start, &line_end, &pos);
+		str = text_search_expand_text(ts, text, strlen(text), pos, replacement);
+		g_free(text);
+		return str;
+	}
+#endif
+	
+	return g_strdup(replacement);
+}
+
+/*
+ * For text that is not in a buffer, and safe to call from any thread;
+ * offsets are in bytes. Finds the first match at or after pos.
+ */
+gboolean text_search_find_text(TextSearch *ts, const gchar *text, gsize len,
+	gsize pos, gsize *match_start, gsize *match_end)
+{
+	const gchar *p, *q;
+#ifdef ENABLE_REGEX
+	GMatchInfo *info;
+	gint s, e;
+	gboolean found;
+	
+	if (ts->regex) {
+		found = g_regex_match_full(ts->regex, text, len, pos,
+			G_REGEX_MATCH_NOTEMPTY, &info, NULL);
+		if (found) {
+			g_match_info_fetch_pos(info, 0, &s, &e);
+			*match_start = s;
+			*match_end = e;
+		}
+		g_match_info_free(info);
+		return found;
+	}
+#endif
+	if (!ts->chars)
+		return FALSE;
+	p = text_search_scan(ts, text + pos, text + len, &q);
+	if (p) {
+		*match_start = p - text;
+		*match_end = q - text;
+	}
+	
+	return p != NULL;
+}
+
+/*
+ * The replacement for the match found at match_start in text. The match is
+ * found again unanchored, as an anchored one runs without JIT and checks
+ * all of text each time; the first match from there is the same one.
+ */
+gchar *text_search_expand_text(TextSearch *ts, const gchar *text, gsize len,
+	gsize match_start, const gchar *replacement)
+{
+#ifdef ENABLE_REGEX
+	GMatchInfo *info;
+	gchar *str = NULL;
+	gint s, e;
+	
+	if (ts->regex) {
+		if (g_regex_match_full(ts->regex, text, len, match_start,
+			G_REGEX_MATCH_NOTEMPTY, &info, NULL)
+			&& g_match_info_fetch_pos(info, 0, &s, &e)
+			&& (gsize) s == match_start)
+			str = g_match_info_expand_references(info, replacement, NULL);
+		g_match_info_free(info);
+		if (str)
+			return str;
+	}
+#endif
+	
+	return g_strdup(replacement);
+}
+
+gboolean text_search_forward(TextSearch *ts, const GtkTextIter *iter,
+	GtkTextIter *match_start, GtkTextIter *match_end, const GtkTextIter *limit)
+{
+	GtkTextIter start, end, bound;
+	gchar *text;
+	const gchar *p, *q;
+	gint segment = MAX(TEXT_SEARCH_FIRST_SEGMENT, ts->chars * 2);
+	
+	if (!ts->chars)
+		return FALSE;
+	
+	if (limit)
+		bound = *limit;
+	else
+		gtk_text_buffer_get_end_iter(gtk_text_iter_get_buffer(iter), &bound);
+#ifdef ENABLE_REGEX
+	if (ts->regex)
+		return text_search_regex_forward(ts, iter,
+			match_start, match_end, &bound);
+#endif
+	start = *iter;
+	while (gtk_text_iter_compare(&start, &bound) < 0) {
+		end = start;
+		gtk_text_iter_forward_chars(&end, segment);
+		if (gtk_text_iter_compare(&end, &bound) > 0)
+			end = bound;
+		text = gtk_text_iter_get_slice(&start, &end);
+		p = text_search_scan(ts, text, text + strlen(text), &q);
+		if (p) {
+			text_search_set_match(&start, text, p, q, match_start, match_end);
+			g_free(text);
+			return TRUE;
+		}
+		g_free(text);
+		if (gtk_text_iter_equal(&end, &bound))
+			break;
+		/* overlap by all but one char, for matches across the seam */
+		start = end;
+		gtk_text_iter_backward_chars(&start, ts->chars - 1);
+		if (segment < TEXT_SEARCH_SEGMENT)
+			segment *= 2;
+	}
+	
+	return FALSE;
+}
+
+gboolean text_search_backward(TextSearch *ts, const GtkTextIter *iter,
+	GtkTextIter *match_start, GtkTextIter *match_end, const GtkTextIter *limit)
+{
+	GtkTextIter start, end, bound;
+	gchar *text;
+	const gchar *p, *q;
+	gint segment = MAX(TEXT_SEARCH_FIRST_SEGMENT, ts->chars * 2);
+	
+	if (!ts->chars)
+		return FALSE;
+	
+	if (limit)
+		bound = *limit;
+	else
+		gtk_text_buffer_get_start_iter(gtk_text_iter_get_buffer(iter), &bound);
+#ifdef ENABLE_REGEX
+	if (ts->regex)
+		return text_search_regex_backward(ts, iter,
+			match_start, match_end, &bound);
+#endif
+	end = *iter;
+	while (gtk_text_iter_compare(&end, &bound) > 0) {
+		start = end;
+		gtk_text_iter_backward_chars(&start, segment);
+		if (gtk_text_iter_compare(&start, &bound) < 0)
+			start = bound;
+		text = gtk_text_iter_get_slice(&start, &end);
+		p = text_search_rscan(ts, text, text + strlen(text), &q);
+		if (p) {
+			text_search_set_match(&start, text, p, q, match_start, match_end);
+			g_free(text);
+			return TRUE;
+		}
+		g_free(text);
+		if (gtk_text_iter_equal(&start, &bound))
+			break;
+		end = start;
+		gtk_text_iter_forward_chars(&end, ts->chars - 1);
+		if (segment < TEXT_SEARCH_SEGMENT)
+			segment *= 2;
+	}
+	
+	return FALSE;
+}
+
+/*
+ * Calls func on each match in [start, end), not overlapping, from a single
+ * slice; func must leave the buffer as it is. If next is given, it is set
+ * to where a search of what follows end has to resume so as to neither
+ * miss nor repeat a match.
+ */
+gint text_search_foreach(TextSearch *ts, const GtkTextIter *start,
+	const GtkTextIter *end, TextSearchFunc func, gpointer data, GtkTextIter *next)
+{
+	GtkTextIter match_start, match_end;
+	gchar *text, *text_end;
+	const gchar *p, *q, *prev;
+	gint count = 0;
+	
+#ifdef ENABLE_REGEX
+	if (ts->regex)
+		return text_search_regex_foreach(ts, start, end, func, data, next);
+#endif
+	if (next) {
+		*next = *end;
+		gtk_text_iter_backward_chars(next, ts->chars - 1);
+		if (gtk_text_iter_compare(next, start) <= 0)
+			*next = *end;
+	}
+	if (!ts->chars)
+		return 0;
+	
+	text = gtk_text_iter_get_slice(start, end);
+	text_end = text + strlen(text);
+	match_end = *start;
+	for (prev = text; (p = text_search_scan(ts, prev, text_end, &q)); prev = q) {
+		match_start = match_end;
+		gtk_text_iter_forward_chars(&match_start, g_utf8_strlen(prev, p - prev));
+		match_end = match_start;
+		gtk_text_iter_forward_chars(&match_end, g_utf8_strlen(p, q - p));
+		func(&match_start, &match_end, data);
+		count++;
+	}
+	g_free(text);
+	if (next && count && gtk_text_iter_compare(&match_end, next) > 0)
+		*next = match_end;
+	
+	return count;
+}
@@ -0,0 +1,56 @@
+/*
+ *  Leafpad - GTK+ based simple text editor
+ *  Copyright (C) 2004-2005 Tarot Osuji
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TEXTSEARCH_H
+#define _TEXTSEARCH_H
+
+#if GLIB_CHECK_VERSION(2, 14, 0)
+#	define ENABLE_REGEX
+#endif
+
+typedef enum {
+	TEXT_SEARCH_MATCH_CASE = 1 << 0,
+	TEXT_SEARCH_REGEX      = 1 << 1
+} TextSearchFlags;
+
+typedef struct _TextSearch TextSearch;
+typedef void (*TextSearchFunc)(GtkTextIter *match_start,
+	GtkTextIter *match_end, gpointer data);
+
+TextSearch *text_search_new(const gchar *str, TextSearchFlags flags,
+	GError **error);
+TextSearch *text_search_ref(TextSearch *ts);
+void text_search_unref(TextSearch *ts);
+glong text_search_get_length(TextSearch *ts);
+void text_search_scan_offsets(TextSearch *ts, const gchar *text,
+	gint offset, gint limit, GArray *starts);
+gboolean text_search_forward(TextSearch *ts, const GtkTextIter *iter,
+	GtkTextIter *match_start, GtkTextIter *match_end, const GtkTextIter *limit);
+gboolean text_search_backward(TextSearch *ts, const GtkTextIter *iter,
+	GtkTextIter *match_start, GtkTextIter *match_end, const GtkTextIter *limit);
+gint text_search_foreach(TextSearch *ts, const GtkTextIter *start,
+	const GtkTextIter *end, TextSearchFunc func, gpointer data, GtkTextIter *next);
+gchar *text_search_expand(TextSearch *ts, const GtkTextIter *match_start,
+	const GtkTextIter *match_end, const gchar *replacement);
+gboolean text_search_find_text(TextSearch *ts, const gchar *text, gsize len,
+	gsize pos, gsize *match_start, gsize *match_end);
+gchar *text_search_expand_text(TextSearch *ts, const gchar *text, gsize len,
+	gsize match_start, const gchar *replacement);
+
+#endif /* _TEXTSEARCH_H */
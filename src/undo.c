@@ -17,23 +17,98 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "view.h"
 #include "undo.h"
 
 #define DV(x)
 
+#if GLIB_CHECK_VERSION(2, 16, 0)
+#	define ENABLE_UNDO_JOURNAL
+#endif
+
 //"GTK_TEXT_VIEW(view)->overwrite_mode" can get overwrite_mode state
 
+/*
+ * Undo texts are packed into shared chunks, each freed once no entry uses
+ * it any more. Texts too big to share a chunk get one of their own.
+ */
+#define UNDO_CHUNK_SIZE		(64 * 1024)
+#define UNDO_CHUNK_OWN_SIZE	(UNDO_CHUNK_SIZE / 4)
+
+/*
+ * Oldest groups are dropped once the history outgrows its budget. Texts
+ * owning a chunk are deflated when they sink below the newest entries,
+ * which gives their memory back at once; they are inflated on replay.
+ */
+#define UNDO_DEFAULT_MEMORY	(32 * 1024 * 1024)
+#define UNDO_COLD_DEPTH		16
+
+/*
+ * A big group whose edits all move one way through the buffer is replayed
+ * as one rewrite of the span it covers instead of an edit per entry, as
+ * long as the span isn't mostly text the group never touched.
+ */
+#define UNDO_BATCH_MIN		16
+#define UNDO_BATCH_GAP		4096	/* chars per entry */
+
+typedef struct {
+	guint live;	/* texts still in use */
+	gsize used;
+	gsize size;
+	gpointer mapped;	/* journal the texts were restored from */
+	gchar data[1];
+} UndoChunk;
+
+/*
+ * Positions are kept as line and byte index, which the buffer resolves
+ * without counting characters along the line.
+ */
+typedef struct {
+	gint line;
+	gint index;
+} UndoPos;
+
 typedef struct {
 	gchar command;
-	gint start;
-	gint end;
+	UndoPos start;
+	UndoPos end;
 	gboolean seq; // sequency flag
 	gchar *str;
+	gsize len;
+	gsize zlen;	/* size of str when deflated, else 0 */
+	UndoChunk *chunk;
+	guint id;	/* order of creation */
 } UndoInfo;
 
+/* a ring, so that entries can later be dropped from the bottom too */
+typedef struct {
+	UndoInfo *items;
+	guint head;
+	guint len;
+	guint size;	/* a power of two */
+} UndoStack;
+
+/*
+ * History forms a tree. The undo stack is the path from the start to the
+ * current state and the redo stack the branch ahead of it. A branch that
+ * an edit turns away from is kept aside as it is, laid out like the redo
+ * stack, holding only the entries past the one it grows from.
+ */
+typedef struct {
+	UndoStack stack;
+	guint fork;	/* id of the entry it grows from */
+} UndoBranch;
+
 enum {
 	INS = 0,
 	BS,
@@ -42,8 +117,23 @@ enum {
 
 static GtkWidget *undo_w = NULL;
 static GtkWidget *redo_w = NULL;
-static GList *undo_list = NULL;
-static GList *redo_list = NULL;
+static GtkWidget *older_w = NULL;
+static GtkWidget *newer_w = NULL;
+static UndoStack undo_stack = { NULL, 0, 0, 0 };
+static UndoStack redo_stack = { NULL, 0, 0, 0 };
+static GList *undo_branches = NULL;
+static guint undo_branch_count = 0;
+static gsize undo_branch_slots = 0;	/* UndoInfo slots held by branches */
+static guint undo_branch_oldest = 0;	/* tips and forks over all branches, */
+static guint undo_branch_newest = 0;	/* kept so that an edit looks at none */
+static guint undo_branch_min_fork = 0;
+static guint undo_clock = 0;
+static guint undo_base = 0;	/* id of the last entry dropped */
+static UndoChunk *undo_chunk = NULL;
+static gsize undo_chunk_bytes = 0;
+static gsize undo_max_memory = UNDO_DEFAULT_MEMORY;
+static guint undo_max_levels = 0;
+static gboolean undo_compress = TRUE;
 static GString *undo_gstr;
 static UndoInfo *ui_tmp;
 static gint modified_step;
@@ -52,62 +142,814 @@ static gboolean seq_reserve = FALSE;
 
 static void undo_flush_temporal_buffer(GtkTextBuffer *buffer);
 
-static GList *undo_clear_info_list(GList *info_list)
+static UndoChunk *undo_chunk_new(gsize size)
+{
+	UndoChunk *chunk = g_malloc(G_STRUCT_OFFSET(UndoChunk, data) + size);
+	
+	chunk->live = 0;
+	chunk->used = 0;
+	chunk->size = size;
+	chunk->mapped = NULL;
+	undo_chunk_bytes += size;
+	
+	return chunk;
+}
+
+static void undo_chunk_free(UndoChunk *chunk)
+{
+#ifdef ENABLE_UNDO_JOURNAL
+#	if GLIB_CHECK_VERSION(2, 22, 0)
+	if (chunk->mapped)
+		g_mapped_file_unref(chunk->mapped);
+#	else
+	if (chunk->mapped)
+		g_mapped_file_free(chunk->mapped);
+#	endif
+#endif
+	undo_chunk_bytes -= chunk->size;
+	g_free(chunk);
+}
+
+static gchar *undo_chunk_strdup(const gchar *str, gsize len, UndoChunk **chunkp)
+{
+	UndoChunk *chunk;
+	gchar *p;
+	
+	if (len + 1 > UNDO_CHUNK_OWN_SIZE)
+		chunk = undo_chunk_new(len + 1);
+	else {
+		if (!undo_chunk || undo_chunk->size - undo_chunk->used < len + 1) {
+			if (undo_chunk && !undo_chunk->live)
+				undo_chunk_free(undo_chunk);
+			undo_chunk = undo_chunk_new(UNDO_CHUNK_SIZE);
+		}
+		chunk = undo_chunk;
+	}
+	p = chunk->data + chunk->used;
+	memcpy(p, str, len);
+	p[len] = '\0';
+	chunk->used += len + 1;
+	chunk->live++;
+	*chunkp = chunk;
+	
+	return p;
+}
+
+static void undo_chunk_release(UndoChunk *chunk)
+{
+	if (--chunk->live)
+		return;
+	if (chunk == undo_chunk)
+		chunk->used = 0;
+	else
+		undo_chunk_free(chunk);
+}
+
+#if GLIB_CHECK_VERSION(2, 24, 0)
+static gboolean undo_convert(GConverter *conv, const gchar *in, gsize in_len,
+	gchar *out, gsize out_size, gsize *out_len)
+{
+	GConverterResult res;
+	gsize bytes_read;
+	
+	res = g_converter_convert(conv, in, in_len, out, out_size,
+		G_CONVERTER_INPUT_AT_END, &bytes_read, out_len, NULL);
+	g_object_unref(conv);
+	
+	return res == G_CONVERTER_FINISHED;
+}
+#endif
+
+static void undo_info_deflate(UndoInfo *ui)
+{
+#if GLIB_CHECK_VERSION(2, 24, 0)
+	UndoChunk *chunk;
+	gsize zlen;
+	
+	if (ui->zlen || ui->len < UNDO_CHUNK_OWN_SIZE || ui->chunk->mapped)
+		return;
+	chunk = undo_chunk_new(ui->len);
+	if (!undo_convert(G_CONVERTER(g_zlib_compressor_new(
+			G_ZLIB_COMPRESSOR_FORMAT_RAW, 1)),
+			ui->str, ui->len, chunk->data, ui->len, &zlen)) {
+		undo_chunk_free(chunk);
+		return;
+	}
+	undo_chunk_bytes -= chunk->size - zlen;
+	chunk = g_realloc(chunk, G_STRUCT_OFFSET(UndoChunk, data) + zlen);
+	chunk->size = chunk->used = zlen;
+	chunk->live = 1;
+	undo_chunk_release(ui->chunk);
+	ui->chunk = chunk;
+	ui->str = chunk->data;
+	ui->zlen = zlen;
+#endif
+}
+
+/* returns ui->str itself unless it has to be inflated into a new string */
+static gchar *undo_info_get_text(UndoInfo *ui)
+{
+	gchar *str;
+	gsize len = 0;
+	
+	if (!ui->zlen)
+		return ui->str;
+	str = g_malloc(ui->len + 1);
+#if GLIB_CHECK_VERSION(2, 24, 0)
+	if (!undo_convert(G_CONVERTER(g_zlib_decompressor_new(
+			G_ZLIB_COMPRESSOR_FORMAT_RAW)),
+			ui->str, ui->zlen, str, ui->len + 1, &len))
+		g_warning("undo: can't inflate history text");
+#endif
+	str[len] = '\0';
+	
+	return str;
+}
+
+static UndoInfo *undo_stack_nth(UndoStack *stack, guint n)
+{
+	return &stack->items[(stack->head + n) & (stack->size - 1)];
+}
+
+static UndoInfo *undo_stack_top(UndoStack *stack)
+{
+	return stack->len ? undo_stack_nth(stack, stack->len - 1) : NULL;
+}
+
+static void undo_stack_push(UndoStack *stack, const UndoInfo *ui)
+{
+	UndoInfo *items;
+	guint i, size;
+	
+	if (stack->len == stack->size) {
+		size = stack->size ? stack->size * 2 : 64;
+		items = g_new(UndoInfo, size);
+		for (i = 0; i < stack->len; i++)
+			items[i] = *undo_stack_nth(stack, i);
+		g_free(stack->items);
+		stack->items = items;
+		stack->head = 0;
+		stack->size = size;
+	}
+	*undo_stack_nth(stack, stack->len++) = *ui;
+}
+
+static void undo_stack_pop(UndoStack *stack, UndoInfo *ui)
+{
+	*ui = *undo_stack_top(stack);
+	stack->len--;
+}
+
+static void undo_stack_shift(UndoStack *stack, UndoInfo *ui)
+{
+	*ui = *undo_stack_nth(stack, 0);
+	stack->head = (stack->head + 1) & (stack->size - 1);
+	stack->len--;
+}
+
+static void undo_stack_clear(UndoStack *stack)
+{
+	guint i;
+	
+	for (i = 0; i < stack->len; i++)
+		undo_chunk_release(undo_stack_nth(stack, i)->chunk);
+	stack->head = 0;
+	stack->len = 0;
+}
+
+/* index of the entry with id, or -1; ids grow along every path */
+static gint undo_stack_find(UndoStack *stack, guint id, gboolean reversed)
+{
+	guint lo = 0, hi = stack->len, mid, mid_id;
+	
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		mid_id = undo_stack_nth(stack, reversed ? stack->len - 1 - mid : mid)->id;
+		if (mid_id == id)
+			return reversed ? stack->len - 1 - mid : mid;
+		if (mid_id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	return -1;
+}
+
+static void undo_branch_free(UndoBranch *branch)
+{
+	undo_stack_clear(&branch->stack);
+	g_free(branch->stack.items);
+	g_free(branch);
+}
+
+/* the id of the newest entry reachable on a branch */
+static guint undo_branch_tip(UndoStack *stack)
+{
+	return undo_stack_nth(stack, 0)->id;
+}
+
+static void undo_branch_add(UndoBranch *branch)
+{
+	guint tip = undo_branch_tip(&branch->stack);
+	
+	if (!undo_branches || tip < undo_branch_oldest)
+		undo_branch_oldest = tip;
+	if (!undo_branches || tip > undo_branch_newest)
+		undo_branch_newest = tip;
+	if (!undo_branches || branch->fork < undo_branch_min_fork)
+		undo_branch_min_fork = branch->fork;
+	undo_branches = g_list_prepend(undo_branches, branch);
+	undo_branch_count++;
+	undo_branch_slots += branch->stack.size;
+}
+
+/* takes branch off the list, without freeing it */
+static void undo_branch_remove(UndoBranch *branch)
+{
+	GList *l;
+	guint tip;
+	
+	undo_branches = g_list_remove(undo_branches, branch);
+	undo_branch_count--;
+	undo_branch_slots -= branch->stack.size;
+	for (l = undo_branches; l; l = l->next) {
+		branch = l->data;
+		tip = undo_branch_tip(&branch->stack);
+		if (l == undo_branches || tip < undo_branch_oldest)
+			undo_branch_oldest = tip;
+		if (l == undo_branches || tip > undo_branch_newest)
+			undo_branch_newest = tip;
+		if (l == undo_branches || branch->fork < undo_branch_min_fork)
+			undo_branch_min_fork = branch->fork;
+	}
+}
+
+/* keeps the redo stack as a branch, rather than freeing it */
+static void undo_stash_redo(void)
+{
+	UndoBranch *branch;
+	
+	if (!redo_stack.len)
+		return;
+	branch = g_new(UndoBranch, 1);
+	branch->stack = redo_stack;
+	branch->fork = undo_stack.len ? undo_stack_top(&undo_stack)->id : undo_base;
+	undo_branch_add(branch);
+	redo_stack.items = NULL;
+	redo_stack.head = redo_stack.len = redo_stack.size = 0;
+}
+
+static UndoBranch *undo_branch_find(guint id)
+{
+	GList *l;
+	UndoBranch *branch;
+	
+	for (l = undo_branches; l; l = l->next) {
+		branch = l->data;
+		if (undo_stack_find(&branch->stack, id, TRUE) >= 0)
+			return branch;
+	}
+	
+	return NULL;
+}
+
+/* whether the state a branch grows from can still be reached */
+static gboolean undo_fork_exists(guint fork, guint depth)
+{
+	UndoBranch *branch;
+	
+	if (fork == undo_base || undo_stack_find(&undo_stack, fork, FALSE) >= 0
+		|| undo_stack_find(&redo_stack, fork, TRUE) >= 0)
+		return TRUE;
+	branch = undo_branch_find(fork);
+	
+	return branch && depth < undo_branch_count
+		&& undo_fork_exists(branch->fork, depth + 1);
+}
+
+static void undo_branches_prune(void)
+{
+	GList *l, *next;
+	UndoBranch *branch;
+	
+	for (l = undo_branches; l; l = next) {
+		next = l->next;
+		branch = l->data;
+		if (!undo_fork_exists(branch->fork, 0)) {
+			undo_branch_remove(branch);
+			undo_branch_free(branch);
+			next = undo_branches;	/* others may hang off it */
+		}
+	}
+}
+
+static void undo_branches_clear(void)
+{
+	g_list_foreach(undo_branches, (GFunc)undo_branch_free, NULL);
+	g_list_free(undo_branches);
+	undo_branches = NULL;
+	undo_branch_count = 0;
+	undo_branch_slots = 0;
+}
+
+/* the id of the newest entry on the current path, redo stack included */
+static guint undo_current_tip(void)
+{
+	if (redo_stack.len)
+		return undo_branch_tip(&redo_stack);
+	return undo_stack.len ? undo_stack_top(&undo_stack)->id : undo_base;
+}
+
+/* the branch whose tip comes next in time, older or newer than the current */
+static UndoBranch *undo_branch_next(gboolean newer)
+{
+	UndoBranch *branch, *target = NULL;
+	GList *l;
+	guint tip = undo_current_tip(), target_tip = 0;
+	
+	for (l = undo_branches; l; l = l->next) {
+		branch = l->data;
+		if ((undo_branch_tip(&branch->stack) > tip) != newer)
+			continue;
+		if (!target || (undo_branch_tip(&branch->stack) < target_tip) == newer) {
+			target = branch;
+			target_tip = undo_branch_tip(&branch->stack);
+		}
+	}
+	
+	return target;
+}
+
+/* updated along with undo_w and redo_w, as the same changes add or pass branches */
+static void undo_set_branch_sensitive(void)
+{
+	if (!older_w)
+		return;
+	gtk_widget_set_sensitive(older_w,
+		undo_branches && undo_branch_oldest <= undo_current_tip());
+	gtk_widget_set_sensitive(newer_w,
+		undo_branches && undo_branch_newest > undo_current_tip());
+}
+
+#ifdef ENABLE_UNDO_JOURNAL
+/*
+ * The journal is an append-only log of what happens to the two stacks,
+ * one per file in the cache directory. Each save appends the SHA-1 of the
+ * file as written. On reopen, the log is replayed up to the last save that
+ * matches the file on disk. The texts stay in the mapped log and are not
+ * copied.
+ */
+#define UNDO_JOURNAL_MAGIC	"LPUJ"
+#define UNDO_JOURNAL_VERSION	1
+#define UNDO_JOURNAL_SLACK	(1024 * 1024)
+
+enum {
+	JOURNAL_EDIT = 0,	/* push, clearing redo; followed by the text */
+	JOURNAL_SEQ,
+	JOURNAL_UNDO,	/* len entries moved over */
+	JOURNAL_REDO,
+	JOURNAL_DROP,	/* len oldest entries evicted */
+	JOURNAL_SAVE	/* followed by the digest of the file */
+};
+
+typedef struct {
+	guint8 type;
+	guint8 command;
+	guint8 seq;
+	guint8 pad;
+	gint32 start_line;
+	gint32 start_index;
+	gint32 end_line;
+	gint32 end_index;
+	guint32 len;
+} UndoRecord;
+
+static gboolean journal_enabled = FALSE;
+static FILE *journal_fp = NULL;
+static gchar *journal_filename = NULL;
+
+static void undo_journal_close(void)
+{
+	if (journal_fp)
+		fclose(journal_fp);
+	journal_fp = NULL;
+	g_free(journal_filename);
+	journal_filename = NULL;
+}
+
+static void undo_journal_write(guint8 type, const UndoInfo *ui,
+	const gchar *data, guint32 len)
+{
+	UndoRecord rec;
+	
+	if (!journal_fp)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	if (ui) {
+		rec.command = ui->command;
+		rec.seq = ui->seq;
+		rec.start_line = ui->start.line;
+		rec.start_index = ui->start.index;
+		rec.end_line = ui->end.line;
+		rec.end_index = ui->end.index;
+	}
+	rec.len = len;
+	if (fwrite(&rec, sizeof(rec), 1, journal_fp) != 1
+		|| (data && fwrite(data, 1, len + 1, journal_fp) != len + 1)
+		|| fflush(journal_fp) != 0)
+		undo_journal_close();
+}
+
+static gsize undo_record_size(const UndoRecord *rec)
+{
+	switch (rec->type) {
+	case JOURNAL_EDIT:
+	case JOURNAL_SAVE:
+		return sizeof(UndoRecord) + rec->len + 1;
+	default:
+		return sizeof(UndoRecord);
+	}
+}
+
+static void undo_mapped_file_free(GMappedFile *mapped)
+{
+#if GLIB_CHECK_VERSION(2, 22, 0)
+	g_mapped_file_unref(mapped);
+#else
+	g_mapped_file_free(mapped);
+#endif
+}
+
+static gchar *undo_journal_get_path(const gchar *filename)
+{
+	gchar *dir, *digest, *path;
+	
+	dir = g_build_filename(g_get_user_cache_dir(), PACKAGE, "undo", NULL);
+	g_mkdir_with_parents(dir, 0700);
+	digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, filename, -1);
+	path = g_build_filename(dir, digest, NULL);
+	g_free(digest);
+	g_free(dir);
+	
+	return path;
+}
+
+static gchar *undo_journal_digest_file(const gchar *filename)
+{
+	GMappedFile *mapped;
+	gchar *digest;
+	
+	mapped = g_mapped_file_new(filename, FALSE, NULL);
+	if (!mapped)
+		return NULL;
+	digest = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+		(const guchar *)g_mapped_file_get_contents(mapped),
+		g_mapped_file_get_length(mapped));
+	undo_mapped_file_free(mapped);
+	
+	return digest;
+}
+
+/* starts the journal over from what the stacks hold now */
+static void undo_journal_create(const gchar *path, const gchar *filename,
+	const gchar *digest)
+{
+	gchar *tmpname, *str;
+	guint32 n = strlen(filename);
+	guint32 version = UNDO_JOURNAL_VERSION;
+	UndoInfo *ui;
+	guint i;
+	
+	tmpname = g_strconcat(path, ".tmp", NULL);
+	journal_fp = g_fopen(tmpname, "wb");
+	if (journal_fp) {
+		journal_filename = g_strdup(filename);
+		fwrite(UNDO_JOURNAL_MAGIC, 4, 1, journal_fp);
+		fwrite(&version, sizeof(version), 1, journal_fp);
+		fwrite(&n, sizeof(n), 1, journal_fp);
+		fwrite(filename, n, 1, journal_fp);
+		/* redo entries go in as edits, then are undone again */
+		for (i = 0; i < undo_stack.len + redo_stack.len; i++) {
+			ui = i < undo_stack.len ? undo_stack_nth(&undo_stack, i)
+				: undo_stack_nth(&redo_stack,
+					redo_stack.len - 1 - (i - undo_stack.len));
+			str = undo_info_get_text(ui);
+			undo_journal_write(JOURNAL_EDIT, ui, str, ui->len);
+			if (str != ui->str)
+				g_free(str);
+		}
+		if (redo_stack.len)
+			undo_journal_write(JOURNAL_UNDO, NULL, NULL, redo_stack.len);
+		undo_journal_write(JOURNAL_SAVE, NULL, digest, strlen(digest));
+		if (journal_fp && g_rename(tmpname, path) != 0)
+			undo_journal_close();
+	}
+	if (!journal_fp)
+		g_unlink(tmpname);
+	g_free(tmpname);
+}
+
+/* returns the end of the last save record for digest, if any */
+static const gchar *undo_journal_find_save(const gchar *contents, gsize length,
+	const gchar **start, const gchar *filename, const gchar *digest)
+{
+	UndoRecord rec;
+	const gchar *p, *end = NULL;
+	guint32 version, n;
+	
+	if (length < 12)
+		return NULL;
+	memcpy(&version, contents + 4, sizeof(version));
+	memcpy(&n, contents + 8, sizeof(n));
+	if (memcmp(contents, UNDO_JOURNAL_MAGIC, 4) != 0
+		|| version != UNDO_JOURNAL_VERSION
+		|| n != strlen(filename) || n > length - 12
+		|| memcmp(contents + 12, filename, n) != 0)
+		return NULL;
+	*start = contents + 12 + n;
+	
+	/* a record cut short by a crash ends the log */
+	for (p = *start; p + sizeof(rec) <= contents + length;
+		p += undo_record_size(&rec)) {
+		memcpy(&rec, p, sizeof(rec));
+		if (undo_record_size(&rec) > (gsize)(contents + length - p))
+			break;
+		if (rec.type == JOURNAL_SAVE && rec.len == strlen(digest)
+			&& memcmp(p + sizeof(rec), digest, rec.len) == 0)
+			end = p + undo_record_size(&rec);
+	}
+	
+	return end;
+}
+
+static gboolean undo_journal_restore(GtkTextBuffer *buffer, const gchar *path,
+	const gchar *filename, const gchar *digest)
 {
-	while (g_list_length(info_list)) {
-		g_free(((UndoInfo *)info_list->data)->str);
-		g_free(info_list->data);
-		info_list = g_list_delete_link(info_list, info_list);
+	GMappedFile *mapped;
+	UndoChunk *chunk;
+	UndoRecord rec;
+	UndoInfo ui;
+	const gchar *contents, *p, *start, *end;
+	gsize live = 0;
+	guint32 n;
+	
+	mapped = g_mapped_file_new(path, FALSE, NULL);
+	if (!mapped)
+		return FALSE;
+	contents = g_mapped_file_get_contents(mapped);
+	end = undo_journal_find_save(contents, g_mapped_file_get_length(mapped),
+		&start, filename, digest);
+	if (!end) {
+		undo_mapped_file_free(mapped);
+		return FALSE;
 	}
-	return info_list;
+	
+	/* the extra reference keeps the mapping while it is read */
+	chunk = undo_chunk_new(0);
+	chunk->mapped = mapped;
+	chunk->live = 1;
+	for (p = start; p < end; p += undo_record_size(&rec)) {
+		memcpy(&rec, p, sizeof(rec));
+		switch (rec.type) {
+		case JOURNAL_EDIT:
+			ui.command = rec.command;
+			ui.seq = rec.seq;
+			ui.start.line = rec.start_line;
+			ui.start.index = rec.start_index;
+			ui.end.line = rec.end_line;
+			ui.end.index = rec.end_index;
+			ui.str = (gchar *)p + sizeof(rec);
+			ui.len = rec.len;
+			ui.zlen = 0;
+			ui.chunk = chunk;
+			ui.id = ++undo_clock;
+			chunk->live++;
+			undo_stack_clear(&redo_stack);
+			undo_stack_push(&undo_stack, &ui);
+			break;
+		case JOURNAL_SEQ:
+			if (undo_stack.len)
+				undo_stack_top(&undo_stack)->seq = rec.seq;
+			break;
+		case JOURNAL_UNDO:
+			for (n = rec.len; n-- && undo_stack.len; ) {
+				undo_stack_pop(&undo_stack, &ui);
+				undo_stack_push(&redo_stack, &ui);
+			}
+			break;
+		case JOURNAL_REDO:
+			for (n = rec.len; n-- && redo_stack.len; ) {
+				undo_stack_pop(&redo_stack, &ui);
+				undo_stack_push(&undo_stack, &ui);
+			}
+			break;
+		case JOURNAL_DROP:
+			for (n = rec.len; n-- && undo_stack.len; ) {
+				undo_stack_shift(&undo_stack, &ui);
+				undo_chunk_release(ui.chunk);
+				undo_base = ui.id;
+			}
+			break;
+		}
+	}
+	for (n = 0; n < undo_stack.len; n++)
+		live += undo_stack_nth(&undo_stack, n)->len;
+	for (n = 0; n < redo_stack.len; n++)
+		live += undo_stack_nth(&redo_stack, n)->len;
+	
+	/* carry on appending, unless the log is mostly dropped history */
+	if ((gsize)(end - contents) > live * 2 + UNDO_JOURNAL_SLACK)
+		undo_journal_create(path, filename, digest);
+	else if (truncate(path, end - contents) == 0
+		&& (journal_fp = g_fopen(path, "ab")))
+		journal_filename = g_strdup(filename);
+	undo_chunk_release(chunk);
+	
+	modified_step = undo_stack.len;
+	gtk_widget_set_sensitive(undo_w, undo_stack.len != 0);
+	gtk_widget_set_sensitive(redo_w, redo_stack.len != 0);
+	undo_set_branch_sensitive();
+	
+	return TRUE;
+}
+
+/* a branch brought back is logged as fresh edits, undone again */
+static void undo_journal_write_redo(void)
+{
+	UndoInfo *ui;
+	gchar *str;
+	guint i;
+	
+	if (!journal_fp || !redo_stack.len)
+		return;
+	for (i = redo_stack.len; i-- > 0; ) {
+		ui = undo_stack_nth(&redo_stack, i);
+		str = undo_info_get_text(ui);
+		undo_journal_write(JOURNAL_EDIT, ui, str, ui->len);
+		if (str != ui->str)
+			g_free(str);
+	}
+	undo_journal_write(JOURNAL_UNDO, NULL, NULL, redo_stack.len);
+}
+#else
+#	define undo_journal_write(type, ui, data, len)
+#	define undo_journal_write_redo()
+#	define undo_journal_close()
+#endif
+
+gsize undo_get_memory_usage(void)
+{
+	gsize size = undo_stack.size + redo_stack.size + undo_branch_slots;
+	
+	return undo_chunk_bytes + undo_gstr->allocated_len
+		+ size * sizeof(UndoInfo);
 }
 
-static void undo_append_undo_info(GtkTextBuffer *buffer, gchar command, gint start, gint end, gchar *str)
+/* number of entries undone along with the oldest one */
+static guint undo_oldest_group_len(void)
 {
-	UndoInfo *ui = g_malloc(sizeof(UndoInfo));
+	guint n = 0;
 	
-	ui->command = command;
-	ui->start = start;
-	ui->end = end;
-//	ui->seq = FALSE;
-	ui->seq = seq_reserve;
-	ui->str = str;
+	while (n < undo_stack.len && undo_stack_nth(&undo_stack, n++)->seq);
+	
+	return n;
+}
+
+static void undo_compact(void)
+{
+	UndoInfo ui;
+	guint n;
+	
+	if (undo_compress && undo_stack.len > UNDO_COLD_DEPTH)
+		undo_info_deflate(undo_stack_nth(&undo_stack,
+			undo_stack.len - 1 - UNDO_COLD_DEPTH));
+	
+	/* side branches go first, oldest first */
+	while (undo_branches && undo_max_memory
+		&& undo_get_memory_usage() > undo_max_memory) {
+		GList *l;
+		UndoBranch *oldest = NULL;
+		
+		for (l = undo_branches; !oldest; l = l->next)
+			if (undo_branch_tip(&((UndoBranch *)l->data)->stack)
+				== undo_branch_oldest)
+				oldest = l->data;
+		undo_branch_remove(oldest);
+		undo_branch_free(oldest);
+		undo_branches_prune();
+	}
+	
+	while ((undo_max_levels && undo_stack.len > undo_max_levels)
+		|| (undo_max_memory && undo_get_memory_usage() > undo_max_memory)) {
+		n = undo_oldest_group_len();
+		if (n == undo_stack.len)	/* keep the newest group whole */
+			break;
+		modified_step -= n;
+		undo_journal_write(JOURNAL_DROP, NULL, NULL, n);
+		while (n--) {
+			undo_stack_shift(&undo_stack, &ui);
+			undo_chunk_release(ui.chunk);
+			undo_base = ui.id;
+		}
+		/* only a branch growing from a dropped entry can lose its fork */
+		if (undo_branches && undo_branch_min_fork < undo_base)
+			undo_branches_prune();
+	}
+}
+
+static void undo_iter_get_pos(const GtkTextIter *iter, UndoPos *pos)
+{
+	pos->line = gtk_text_iter_get_line(iter);
+	pos->index = gtk_text_iter_get_line_index(iter);
+}
+
+static void undo_buffer_get_iter_at_pos(GtkTextBuffer *buffer, GtkTextIter *iter, const UndoPos *pos)
+{
+	gtk_text_buffer_get_iter_at_line_index(buffer, iter, pos->line, pos->index);
+}
+
+static gboolean undo_pos_equal(const UndoPos *a, const UndoPos *b)
+{
+	return a->line == b->line && a->index == b->index;
+}
+
+static gint undo_pos_compare(const UndoPos *a, const UndoPos *b)
+{
+	return a->line != b->line ? a->line - b->line : a->index - b->index;
+}
+
+/* moves pos past str, breaking lines where the buffer does */
+static void undo_pos_advance(UndoPos *pos, const gchar *str, gsize len)
+{
+	gint delim, next;
+	
+	while (len) {
+		pango_find_paragraph_boundary(str, len, &delim, &next);
+		if (delim == next) {
+			pos->index += len;
+			break;
+		}
+		pos->line++;
+		pos->index = 0;
+		str += next;
+		len -= next;
+	}
+}
+
+static void undo_append_undo_info(GtkTextBuffer *buffer, gchar command, const UndoPos *start, const gchar *str, gsize len)
+{
+	UndoInfo ui;
+	
+	ui.command = command;
+	ui.start = *start;
+	ui.end = *start;
+	undo_pos_advance(&ui.end, str, len);
+//	ui.seq = FALSE;
+	ui.seq = seq_reserve;
+	ui.len = len;
+	ui.zlen = 0;
+	ui.str = undo_chunk_strdup(str, len, &ui.chunk);
+	ui.id = ++undo_clock;
 	
 	seq_reserve = FALSE;
 	
-	undo_list = g_list_append(undo_list, ui);
-DV(g_print("undo_cb: %d %s (%d-%d)\n", command, str, start, end));
+	undo_stack_push(&undo_stack, &ui);
+	undo_journal_write(JOURNAL_EDIT, &ui, ui.str, ui.len);
+	undo_compact();
+DV(g_print("undo_cb: %d %s (%d:%d-%d:%d)\n", command, ui.str,
+ui.start.line, ui.start.index, ui.end.line, ui.end.index));
 }
 
-static void undo_create_undo_info(GtkTextBuffer *buffer, gchar command, gint start, gint end)
+static void undo_create_undo_info(GtkTextBuffer *buffer, gchar command,
+	const UndoPos *start, const UndoPos *end, const gchar *str, gsize len)
 {
-	GtkTextIter start_iter, end_iter;
 	gboolean seq_flag = FALSE;
-	gchar *str;
+	gboolean one_char = len && g_utf8_next_char(str) == str + len;
 	gint keyval = get_current_keyval();
 	
-	gtk_text_buffer_get_iter_at_offset(buffer, &start_iter, start);
-	gtk_text_buffer_get_iter_at_offset(buffer, &end_iter, end);
-	str = gtk_text_buffer_get_text(buffer, &start_iter, &end_iter, FALSE);
+	/* nothing is pending while there is something to redo */
+	undo_stash_redo();
 	
 	if (undo_gstr->len) {
-		if ((end - start == 1) && (command == ui_tmp->command)) {
+		if (one_char && (command == ui_tmp->command)) {
 			switch (keyval) {
 			case GDK_BackSpace:
-				if (end == ui_tmp->start)
+				if (undo_pos_equal(end, &ui_tmp->start))
 					seq_flag = TRUE;
 				break;
 			case GDK_Delete:
-				if (start == ui_tmp->start)
+				if (undo_pos_equal(start, &ui_tmp->start))
 					seq_flag = TRUE;
 				break;
 			case GDK_Tab:
 			case GDK_space:
-				if (start == ui_tmp->end)
+				if (undo_pos_equal(start, &ui_tmp->end))
 					seq_flag = TRUE;
 				break;
 			default:
-				if (start == ui_tmp->end)
+				if (undo_pos_equal(start, &ui_tmp->end))
 					if (keyval && keyval < 0xF000)
 						switch (prev_keyval) {
 						case GDK_Return:
@@ -122,76 +964,82 @@ static void undo_create_undo_info(GtkTextBuffer *buffer, gchar command, gint sta
 		if (seq_flag) {
 			switch (command) {
 			case BS:
-				undo_gstr = g_string_prepend(undo_gstr, str);
-				ui_tmp->start--;
+				undo_gstr = g_string_prepend_len(undo_gstr, str, len);
+				ui_tmp->start = *start;
 				break;
 			default:
-				undo_gstr = g_string_append(undo_gstr, str);
-				ui_tmp->end++;
+				undo_gstr = g_string_append_len(undo_gstr, str, len);
+				ui_tmp->end = *end;
 			}
-			redo_list = undo_clear_info_list(redo_list);
 			prev_keyval = keyval;
 			gtk_widget_set_sensitive(undo_w, TRUE);
 			gtk_widget_set_sensitive(redo_w, FALSE);
+			undo_set_branch_sensitive();
 			return;
 		}
-		undo_append_undo_info(buffer, ui_tmp->command, ui_tmp->start, ui_tmp->end, g_strdup(undo_gstr->str));
+		undo_append_undo_info(buffer, ui_tmp->command, &ui_tmp->start,
+			undo_gstr->str, undo_gstr->len);
 		undo_gstr = g_string_erase(undo_gstr, 0, -1);
 	}
 	
 	if (!keyval && prev_keyval)
 		undo_set_sequency(TRUE);
 	
-	if (end - start == 1 &&
+	if (one_char &&
 		((keyval && keyval < 0xF000) ||
 		  keyval == GDK_BackSpace || keyval == GDK_Delete || keyval == GDK_Tab)) {
 		ui_tmp->command = command;
-		ui_tmp->start = start;
-		ui_tmp->end = end;
+		ui_tmp->start = *start;
+		ui_tmp->end = *end;
 		undo_gstr = g_string_erase(undo_gstr, 0, -1);
-		g_string_append(undo_gstr, str);
+		g_string_append_len(undo_gstr, str, len);
 	} else 
-		undo_append_undo_info(buffer, command, start, end, g_strdup(str));
+		undo_append_undo_info(buffer, command, start, str, len);
 	
-	redo_list = undo_clear_info_list(redo_list);
 	prev_keyval = keyval;
 	clear_current_keyval();
 //	keyevent_setval(0);
 	gtk_widget_set_sensitive(undo_w, TRUE);
 	gtk_widget_set_sensitive(redo_w, FALSE);
+	undo_set_branch_sensitive();
 }
 
+/* runs before the text goes in, so iter still marks where it starts */
 static void cb_insert_text(GtkTextBuffer *buffer, GtkTextIter *iter, gchar *str,
 gint len)
 {
-	gint start, end;
+	UndoPos start, end;
 	
 DV(	g_print("insert-text\n"));
-	end = gtk_text_iter_get_offset(iter);
-	start = end - g_utf8_strlen(str, len);
+	undo_iter_get_pos(iter, &start);
+	end = start;
+	undo_pos_advance(&end, str, len);
 	
-	undo_create_undo_info(buffer, INS, start, end);
+	undo_create_undo_info(buffer, INS, &start, &end, str, len);
 }
 
 static void cb_delete_range(GtkTextBuffer *buffer, GtkTextIter *start_iter, GtkTextIter *end_iter)
 {
-	gint start, end;
+	UndoPos start, end;
 	gchar command;
+	gchar *str;
 DV(	g_print("delete-range\n"));
-	start = gtk_text_iter_get_offset(start_iter);
-	end = gtk_text_iter_get_offset(end_iter);
+	undo_iter_get_pos(start_iter, &start);
+	undo_iter_get_pos(end_iter, &end);
+	str = gtk_text_buffer_get_text(buffer, start_iter, end_iter, FALSE);
 	
 	if (get_current_keyval() == GDK_BackSpace)
 		command = BS;
 	else
 		command = DEL;
-	undo_create_undo_info(buffer, command, start, end);
+	undo_create_undo_info(buffer, command, &start, &end, str, strlen(str));
+	g_free(str);
 }
 
 void undo_reset_modified_step(GtkTextBuffer *buffer)
 {
 	undo_flush_temporal_buffer(buffer);
-	modified_step = g_list_length(undo_list);
+	modified_step = undo_stack.len;
 DV(g_print("undo_reset_modified_step: Reseted modified_step by %d\n", modified_step));
 }
 
@@ -199,8 +1047,8 @@ static void undo_check_modified_step(GtkTextBuffer *buffer)
 {
 	gboolean flag;
 	
-	flag = (modified_step == g_list_length(undo_list));
-//g_print("%d - %d = %d\n", modified_step, g_list_length(undo_list), flag);
+	flag = (modified_step == undo_stack.len);
+//g_print("%d - %d = %d\n", modified_step, undo_stack.len, flag);
 	if (gtk_text_buffer_get_modified(buffer) == flag)
 		gtk_text_buffer_set_modified(buffer, !flag);
 //g_print("change!\n");}
@@ -242,25 +1090,87 @@ DV(g_print("end-user-action(block_func)\n"));
 
 void undo_clear_all(GtkTextBuffer *buffer)
 {
-	undo_list = undo_clear_info_list(undo_list);
-	redo_list = undo_clear_info_list(redo_list);
+	/* the journal stays on disk for the next time the file is opened */
+	undo_journal_close();
+	undo_gstr = g_string_erase(undo_gstr, 0, -1);
+	undo_stack_clear(&undo_stack);
+	undo_stack_clear(&redo_stack);
+	undo_branches_clear();
+	undo_base = 0;
 	undo_reset_modified_step(buffer);
 	gtk_widget_set_sensitive(undo_w, FALSE);
 	gtk_widget_set_sensitive(redo_w, FALSE);
+	undo_set_branch_sensitive();
 	
 	ui_tmp->command = INS;
-	undo_gstr = g_string_erase(undo_gstr, 0, -1);
 	prev_keyval = 0;
 }
 
-void undo_init(GtkWidget *view, GtkWidget *undo_button, GtkWidget *redo_button)
+void undo_set_journal(gboolean enable)
+{
+#ifdef ENABLE_UNDO_JOURNAL
+	journal_enabled = enable;
+#endif
+}
+
+gboolean undo_get_journal(void)
+{
+#ifdef ENABLE_UNDO_JOURNAL
+	return journal_enabled;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * To be called once filename holds what the buffer does, after opening
+ * or saving. The journal of the file is restored or started, or gets a
+ * save record if it is the one already open.
+ */
+void undo_journal_attach(GtkTextBuffer *buffer, const gchar *filename)
+{
+#ifdef ENABLE_UNDO_JOURNAL
+	gchar *abspath, *digest, *path;
+	
+	if (!journal_enabled || !filename)
+		return;
+	if (g_path_is_absolute(filename))
+		abspath = g_strdup(filename);
+	else {
+		path = g_get_current_dir();
+		abspath = g_build_filename(path, filename, NULL);
+		g_free(path);
+	}
+	digest = undo_journal_digest_file(abspath);
+	if (digest) {
+		undo_flush_temporal_buffer(buffer);
+		if (journal_fp && strcmp(abspath, journal_filename) == 0)
+			undo_journal_write(JOURNAL_SAVE, NULL, digest, strlen(digest));
+		else {
+			undo_journal_close();
+			path = undo_journal_get_path(abspath);
+			if (undo_stack.len || redo_stack.len
+				|| !undo_journal_restore(buffer, path, abspath, digest))
+				undo_journal_create(path, abspath, digest);
+			g_free(path);
+		}
+		g_free(digest);
+	}
+	g_free(abspath);
+#endif
+}
+
+void undo_init(GtkWidget *view, GtkWidget *undo_button, GtkWidget *redo_button,
+	GtkWidget *older_button, GtkWidget *newer_button)
 {
 	GtkTextBuffer *buffer = GTK_TEXT_VIEW(view)->buffer;
 	 
 	undo_w = undo_button;
 	redo_w = redo_button;
+	older_w = older_button;
+	newer_w = newer_button;
 	
-	g_signal_connect_after(G_OBJECT(buffer), "insert-text",
+	g_signal_connect(G_OBJECT(buffer), "insert-text",
 		G_CALLBACK(cb_insert_text), NULL);
 	g_signal_connect(G_OBJECT(buffer), "delete-range",
 		G_CALLBACK(cb_delete_range), NULL);
@@ -276,6 +1186,20 @@ void undo_init(GtkWidget *view, GtkWidget *undo_button, GtkWidget *redo_button)
 	undo_clear_all(buffer);
 }
 
+void undo_set_memory_limit(gsize max_memory, guint max_levels, gboolean compress)
+{
+	undo_max_memory = max_memory;
+	undo_max_levels = max_levels;
+	undo_compress = compress;
+}
+
+void undo_get_memory_limit(gsize *max_memory, guint *max_levels, gboolean *compress)
+{
+	*max_memory = undo_max_memory;
+	*max_levels = undo_max_levels;
+	*compress = undo_compress;
+}
+
 void undo_set_sequency(gboolean seq)
 {
 	if (!seq) {
@@ -290,8 +1214,10 @@ void undo_set_sequency(gboolean seq)
 		undo_flush_temporal_buffer(NULL);
 	}
 	
-	if (g_list_length(undo_list))
-		((UndoInfo *)g_list_last(undo_list)->data)->seq = seq;
+	if (undo_stack.len) {
+		undo_stack_top(&undo_stack)->seq = seq;
+		undo_journal_write(JOURNAL_SEQ, undo_stack_top(&undo_stack), NULL, 0);
+	}
 DV(g_print("<undo_set_sequency: %d>\n", seq));	
 }
 
@@ -304,42 +1230,54 @@ static void undo_flush_temporal_buffer(GtkTextBuffer *buffer)
 {
 	if (undo_gstr->len) {
 		undo_append_undo_info(buffer, ui_tmp->command,
-			ui_tmp->start, ui_tmp->end, g_strdup(undo_gstr->str));
+			&ui_tmp->start, undo_gstr->str, undo_gstr->len);
 		undo_gstr = g_string_erase(undo_gstr, 0, -1);
 	}
 }
 
+/* moves one entry across, leaving start_iter where the edit put it */
+static void undo_step(GtkTextBuffer *buffer, gboolean redo, UndoInfo *ui,
+	GtkTextIter *start_iter)
+{
+	GtkTextIter end_iter;
+	gchar *str;
+	
+	undo_stack_pop(redo ? &redo_stack : &undo_stack, ui);
+	undo_buffer_get_iter_at_pos(buffer, start_iter, &ui->start);
+	if ((ui->command == INS) == redo) {
+		str = undo_info_get_text(ui);
+		gtk_text_buffer_insert(buffer, start_iter, str, ui->len);
+		if (str != ui->str)
+			g_free(str);
+	} else {
+		undo_buffer_get_iter_at_pos(buffer, &end_iter, &ui->end);
+		gtk_text_buffer_delete(buffer, start_iter, &end_iter);
+	}
+	undo_stack_push(redo ? &undo_stack : &redo_stack, ui);
+	undo_journal_write(redo ? JOURNAL_REDO : JOURNAL_UNDO, NULL, NULL, 1);
+}
+
 gboolean undo_undo_real(GtkTextBuffer *buffer)
 {
-	GtkTextIter start_iter, end_iter;
-	UndoInfo *ui;
+	GtkTextIter start_iter;
+	UndoInfo ui;
 	
 	undo_flush_temporal_buffer(buffer);
-	if (g_list_length(undo_list)) {
+	if (undo_stack.len) {
 //		undo_block_signal(buffer);
-		ui = g_list_last(undo_list)->data;
-		gtk_text_buffer_get_iter_at_offset(buffer, &start_iter, ui->start);
-		switch (ui->command) {
-		case INS:
-			gtk_text_buffer_get_iter_at_offset(buffer, &end_iter, ui->end);
-			gtk_text_buffer_delete(buffer, &start_iter, &end_iter);
-			break;
-		default:
-			gtk_text_buffer_insert(buffer, &start_iter, ui->str, -1);
-		}
-		redo_list = g_list_append(redo_list, ui);
-		undo_list = g_list_delete_link(undo_list, g_list_last(undo_list));
+		undo_step(buffer, FALSE, &ui, &start_iter);
 DV(g_print("cb_edit_undo: undo left = %d, redo left = %d\n",
-g_list_length(undo_list), g_list_length(redo_list)));
+undo_stack.len, redo_stack.len));
 //		undo_unblock_signal(buffer);
-		if (g_list_length(undo_list)) {
-			if (((UndoInfo *)g_list_last(undo_list)->data)->seq)
+		if (undo_stack.len) {
+			if (undo_stack_top(&undo_stack)->seq)
 				return TRUE;
 		} else
 			gtk_widget_set_sensitive(undo_w, FALSE);
 		gtk_widget_set_sensitive(redo_w, TRUE);
-		if (ui->command == DEL)
-			gtk_text_buffer_get_iter_at_offset(buffer, &start_iter, ui->start);
+		undo_set_branch_sensitive();
+		if (ui.command == DEL)
+			undo_buffer_get_iter_at_pos(buffer, &start_iter, &ui.start);
 		gtk_text_buffer_place_cursor(buffer, &start_iter);
 		scroll_to_cursor(buffer, 0.05);
 	}
@@ -349,33 +1287,23 @@ g_list_length(undo_list), g_list_length(redo_list)));
 
 gboolean undo_redo_real(GtkTextBuffer *buffer)
 {
-	GtkTextIter start_iter, end_iter;
-	UndoInfo *ri;
+	GtkTextIter start_iter;
+	UndoInfo ri;
 	
-	if (g_list_length(redo_list)) {
+	if (redo_stack.len) {
 //		undo_block_signal(buffer);
-		ri = g_list_last(redo_list)->data;
-		gtk_text_buffer_get_iter_at_offset(buffer, &start_iter, ri->start);
-		switch (ri->command) {
-		case INS:
-			gtk_text_buffer_insert(buffer, &start_iter, ri->str, -1);
-			break;
-		default:
-			gtk_text_buffer_get_iter_at_offset(buffer, &end_iter, ri->end);
-			gtk_text_buffer_delete(buffer, &start_iter, &end_iter);
-		}
-		undo_list = g_list_append(undo_list, ri);
-		redo_list = g_list_delete_link(redo_list, g_list_last(redo_list));
+		undo_step(buffer, TRUE, &ri, &start_iter);
 DV(g_print("cb_edit_redo: undo left = %d, redo left = %d\n",
-g_list_length(undo_list), g_list_length(redo_list)));
+undo_stack.len, redo_stack.len));
 //		undo_unblock_signal(buffer);
-		if (ri->seq) {
+		if (ri.seq) {
 			undo_set_sequency(TRUE);
 			return TRUE;
 		}
-		if (!g_list_length(redo_list))
+		if (!redo_stack.len)
 			gtk_widget_set_sensitive(redo_w, FALSE);
 		gtk_widget_set_sensitive(undo_w, TRUE);
+		undo_set_branch_sensitive();
 		gtk_text_buffer_place_cursor(buffer, &start_iter);
 		scroll_to_cursor(buffer, 0.05);
 	}
@@ -383,12 +1311,210 @@ g_list_length(undo_list), g_list_length(redo_list)));
 	return FALSE;
 }
 
+typedef struct {
+	UndoInfo *ui;
+	UndoPos start;	/* span to replace, in the buffer as it is now */
+	UndoPos end;
+	gboolean insert;	/* whether ui->str goes in */
+} UndoEdit;
+
+/* number of entries undo_undo_real/undo_redo_real would replay in a row */
+static guint undo_group_len(UndoStack *stack, gboolean redo)
+{
+	guint n = 1;
+	
+	while (n < stack->len
+		&& undo_stack_nth(stack, stack->len - n - !redo)->seq)
+		n++;
+	
+	return n;
+}
+
+static gboolean undo_replay_batch(GtkTextBuffer *buffer, gboolean redo)
+{
+	UndoStack *from = redo ? &redo_stack : &undo_stack;
+	UndoStack *to = redo ? &undo_stack : &redo_stack;
+	UndoEdit *edits, *e, *first, *last;
+	UndoPos new_end;
+	GtkTextIter start_iter, end_iter, iter;
+	GString *gstr;
+	UndoInfo ui;
+	gchar *str;
+	guint i, n;
+	gboolean ok = TRUE;
+	
+	if (!from->len || (n = undo_group_len(from, redo)) < UNDO_BATCH_MIN)
+		return FALSE;
+	
+	/*
+	 * Undo walks back through the buffer, so each entry's position still
+	 * holds. Redo walks forward, so each one is mapped back past the text
+	 * the previous entry changed.
+	 */
+	edits = g_new(UndoEdit, n);
+	for (i = 0; ok && i < n; i++) {
+		e = &edits[i];
+		e->ui = undo_stack_nth(from, from->len - 1 - i);
+		e->insert = (e->ui->command == INS) == redo;
+		e->start = e->ui->start;
+		e->end = e->insert ? e->ui->start : e->ui->end;
+		if (!i)
+			continue;
+		if (!redo) {
+			ok = undo_pos_compare(&e->end, &edits[i - 1].start) <= 0;
+			continue;
+		}
+		new_end = edits[i - 1].insert ?
+			edits[i - 1].ui->end : edits[i - 1].ui->start;
+		if (!(ok = undo_pos_compare(&e->start, &new_end) >= 0))
+			break;
+		if (e->start.line == new_end.line)
+			e->start.index += edits[i - 1].end.index - new_end.index;
+		e->start.line += edits[i - 1].end.line - new_end.line;
+		if (e->insert)
+			e->end = e->start;
+		else {
+			if (e->end.line == new_end.line)
+				e->end.index += edits[i - 1].end.index - new_end.index;
+			e->end.line += edits[i - 1].end.line - new_end.line;
+		}
+	}
+	first = redo ? edits : edits + n - 1;
+	last = redo ? edits + n - 1 : edits;
+	if (ok) {
+		undo_buffer_get_iter_at_pos(buffer, &start_iter, &first->start);
+		undo_buffer_get_iter_at_pos(buffer, &end_iter, &last->end);
+		ok = gtk_text_iter_get_offset(&end_iter)
+			- gtk_text_iter_get_offset(&start_iter) <= n * UNDO_BATCH_GAP;
+	}
+	if (!ok) {
+		g_free(edits);
+		return FALSE;
+	}
+	
+	gstr = g_string_new("");
+	iter = start_iter;
+	for (e = first; ; e += redo ? 1 : -1) {
+		undo_buffer_get_iter_at_pos(buffer, &end_iter, &e->start);
+		str = gtk_text_iter_get_text(&iter, &end_iter);
+		g_string_append(gstr, str);
+		g_free(str);
+		if (e->insert) {
+			str = undo_info_get_text(e->ui);
+			g_string_append_len(gstr, str, e->ui->len);
+			if (str != e->ui->str)
+				g_free(str);
+		}
+		undo_buffer_get_iter_at_pos(buffer, &iter, &e->end);
+		if (e == last)
+			break;
+	}
+	undo_buffer_get_iter_at_pos(buffer, &start_iter, &first->start);
+	gtk_text_buffer_delete(buffer, &start_iter, &iter);
+	gtk_text_buffer_insert(buffer, &start_iter, gstr->str, gstr->len);
+	g_string_free(gstr, TRUE);
+	g_free(edits);
+	
+	for (i = 0; i < n; i++) {
+		undo_stack_pop(from, &ui);
+		undo_stack_push(to, &ui);
+	}
+	undo_journal_write(redo ? JOURNAL_REDO : JOURNAL_UNDO, NULL, NULL, n);
+DV(g_print("undo_replay_batch: %d entries, undo left = %d, redo left = %d\n",
+n, undo_stack.len, redo_stack.len));
+	
+	/* the cursor lands where replaying the entries one by one leaves it */
+	if (redo ? ui.command == INS : ui.command == BS)
+		undo_buffer_get_iter_at_pos(buffer, &iter, &ui.end);
+	else
+		undo_buffer_get_iter_at_pos(buffer, &iter, &ui.start);
+	gtk_widget_set_sensitive(undo_w, undo_stack.len != 0);
+	gtk_widget_set_sensitive(redo_w, redo_stack.len != 0);
+	undo_set_branch_sensitive();
+	gtk_text_buffer_place_cursor(buffer, &iter);
+	scroll_to_cursor(buffer, 0.05);
+	undo_check_modified_step(buffer);
+	
+	return TRUE;
+}
+
 void undo_undo(GtkTextBuffer *buffer)
 {
-	while (undo_undo_real(buffer)) {};
+	undo_flush_temporal_buffer(buffer);
+	if (!undo_replay_batch(buffer, FALSE))
+		while (undo_undo_real(buffer)) {};
 }
 
 void undo_redo(GtkTextBuffer *buffer)
 {
-	while (undo_redo_real(buffer)) {};
+	if (!undo_replay_batch(buffer, TRUE))
+		while (undo_redo_real(buffer)) {};
+}
+
+/* walks to the state right after entry fork, switching branches on the way */
+static gboolean undo_goto_fork(GtkTextBuffer *buffer, guint fork)
+{
+	GtkTextIter iter;
+	UndoBranch *branch;
+	UndoInfo ui;
+	
+	if (fork == undo_base || undo_stack_find(&undo_stack, fork, FALSE) >= 0) {
+		while (undo_stack.len && undo_stack_top(&undo_stack)->id != fork)
+			undo_step(buffer, FALSE, &ui, &iter);
+		return TRUE;
+	}
+	if (undo_stack_find(&redo_stack, fork, TRUE) < 0) {
+		branch = undo_branch_find(fork);
+		if (!branch || !undo_goto_fork(buffer, branch->fork))
+			return FALSE;
+		undo_stash_redo();
+		undo_branch_remove(branch);
+		redo_stack = branch->stack;
+		g_free(branch);
+		undo_journal_write_redo();
+	}
+	while (!undo_stack.len || undo_stack_top(&undo_stack)->id != fork)
+		undo_step(buffer, TRUE, &ui, &iter);
+	
+	return TRUE;
+}
+
+/* switches to the branch whose tip is next in time, and replays it all */
+static gboolean undo_switch_branch(GtkTextBuffer *buffer, gboolean newer)
+{
+	GtkTextIter iter;
+	UndoBranch *target;
+	UndoInfo ui;
+	
+	undo_flush_temporal_buffer(buffer);
+	target = undo_branch_next(newer);
+	if (!target || !undo_goto_fork(buffer, target->fork))
+		return FALSE;
+	
+	undo_stash_redo();
+	undo_branch_remove(target);
+	redo_stack = target->stack;
+	g_free(target);
+	undo_journal_write_redo();
+	while (redo_stack.len)
+		undo_step(buffer, TRUE, &ui, &iter);
+	
+	gtk_widget_set_sensitive(undo_w, undo_stack.len != 0);
+	gtk_widget_set_sensitive(redo_w, FALSE);
+	undo_set_branch_sensitive();
+	gtk_text_buffer_place_cursor(buffer, &iter);
+	scroll_to_cursor(buffer, 0.05);
+	undo_check_modified_step(buffer);
+	
+	return TRUE;
+}
+
+gboolean undo_branch_older(GtkTextBuffer *buffer)
+{
+	return undo_switch_branch(buffer, FALSE);
+}
+
+gboolean undo_branch_newer(GtkTextBuffer *buffer)
+{
+	return undo_switch_branch(buffer, TRUE);
 }
@@ -22,10 +22,19 @@
 
 void undo_reset_modified_step(GtkTextBuffer *buffer);
 void undo_clear_all(GtkTextBuffer *buffer);
-void undo_init(GtkWidget *view, GtkWidget *undo_button, GtkWidget *redo_button);
+void undo_init(GtkWidget *view, GtkWidget *undo_button, GtkWidget *redo_button,
+	GtkWidget *older_button, GtkWidget *newer_button);
 void undo_set_sequency(gboolean seq);
 void undo_set_sequency_reserve(void);
+void undo_set_memory_limit(gsize max_memory, guint max_levels, gboolean compress);
+void undo_get_memory_limit(gsize *max_memory, guint *max_levels, gboolean *compress);
+gsize undo_get_memory_usage(void);
+void undo_set_journal(gboolean enable);
+gboolean undo_get_journal(void);
+void undo_journal_attach(GtkTextBuffer *buffer, const gchar *filename);
 void undo_undo(GtkTextBuffer *buffer);
 void undo_redo(GtkTextBuffer *buffer);
+gboolean undo_branch_older(GtkTextBuffer *buffer);
+gboolean undo_branch_newer(GtkTextBuffer *buffer);
 
 #endif /* _UNDO_H */
@@ -31,6 +31,9 @@ MainWin *create_main_window(void)
  	GtkWidget *menubar;
  	GtkWidget *sw;
  	GtkWidget *view;
+ 	GtkWidget *loadbar;
+ 	GtkWidget *progress;
+ 	GtkWidget *button;
 // 	gint size;
 //	GtkAdjustment *hadj, *vadj;
 	
@@ -81,6 +84,21 @@ MainWin *create_main_window(void)
 	
 	view = create_text_view();
 	gtk_container_add(GTK_CONTAINER(sw), view);
+	
+	/* shown only while a big file is being loaded or saved */
+	loadbar = gtk_hbox_new(FALSE, 4);
+	gtk_container_set_border_width(GTK_CONTAINER(loadbar), 2);
+	gtk_box_pack_start(GTK_BOX(vbox), loadbar, FALSE, FALSE, 0);
+	progress = gtk_progress_bar_new();
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progress), _("Loading..."));
+	gtk_box_pack_start(GTK_BOX(loadbar), progress, TRUE, TRUE, 0);
+	button = gtk_button_new_from_stock(GTK_STOCK_CANCEL);
+	g_signal_connect(G_OBJECT(button), "clicked",
+		G_CALLBACK(on_file_progress_cancel), NULL);
+	gtk_box_pack_start(GTK_BOX(loadbar), button, FALSE, FALSE, 0);
+	gtk_widget_show_all(loadbar);
+	gtk_widget_hide(loadbar);
+	gtk_widget_set_no_show_all(loadbar, TRUE);
 /*	
 	hadj = gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(sw));
 	vadj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(sw));
@@ -93,6 +111,8 @@ MainWin *create_main_window(void)
 	mw->menubar = menubar;
 	mw->view = view;
 	mw->buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
+	mw->loadbar = loadbar;
+	mw->progress = progress;
 	
 	return mw;
 }
@@ -106,3 +126,43 @@ void set_main_window_title(void)
 	g_free(title);
 }
 
+/* the note stays until the title is next set for the file */
+void set_main_window_title_note(const gchar *note)
+{
+	gchar *filename, *title;
+	
+	filename = get_file_basename(pub->fi->filename, TRUE);
+	title = g_strdup_printf("%s%s - %s",
+		gtk_text_buffer_get_modified(pub->mw->buffer) ? "*" : "",
+		filename, note);
+	gtk_window_set_title(GTK_WINDOW(pub->mw->window), title);
+	g_free(title);
+	g_free(filename);
+}
+
+/* only the progress bar takes input, while the buffer must not change */
+void set_main_window_busy(gboolean busy)
+{
+	gtk_widget_set_sensitive(pub->mw->menubar, !busy);
+	if (busy)
+		gtk_grab_add(pub->mw->loadbar);
+	else
+		gtk_grab_remove(pub->mw->loadbar);
+}
+
+void set_main_window_progress_text(const gchar *text)
+{
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(pub->mw->progress), text);
+}
+
+void show_main_window_progress(gdouble fraction)
+{
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(pub->mw->progress),
+		CLAMP(fraction, 0, 1));
+	gtk_widget_show(pub->mw->loadbar);
+}
+
+void hide_main_window_progress(void)
+{
+	gtk_widget_hide(pub->mw->loadbar);
+}
@@ -25,9 +25,16 @@ typedef struct {
 	GtkWidget *menubar;
 	GtkWidget *view;
 	GtkTextBuffer *buffer;
+	GtkWidget *loadbar;
+	GtkWidget *progress;
 } MainWin;
 
 MainWin *create_main_window(void);
 void set_main_window_title(void);
+void set_main_window_title_note(const gchar *note);
+void set_main_window_busy(gboolean busy);
+void set_main_window_progress_text(const gchar *text);
+void show_main_window_progress(gdouble fraction);
+void hide_main_window_progress(void);
 
 #endif /* _WINDOW_H */